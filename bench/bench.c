@@ -0,0 +1,750 @@
+// Benchmarks standard AD workloads in forward and reverse mode and prints the
+// results as JSON.
+//
+//   cc -O2 -o bench_grad bench/bench.c -lm
+//   ./bench_grad [min_ms] > results.json
+//
+// Built with -DGRAD_PERF on Linux, reverse-mode results also carry hardware
+// counters per tape node for the record and backward phases, and a
+// "per_op" section measures each op kind on a tape holding only that op.
+
+#define _DEFAULT_SOURCE
+#define GRAD_FORWARD_TAPE_SIZE 64
+#define GRAD_REVERSE_TAPE_SIZE (1 << 20)
+#define GRAD_IMPLEMENTATION
+#include "../grad.h"
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_MAX_INPUTS 16384
+
+static grad_real_t bench_input[BENCH_MAX_INPUTS];
+static volatile double bench_sink;
+static double bench_min_seconds = 0.05;
+
+// Nodes recorded by the last reverse-mode call, over all its scopes, and the
+// largest single tape among them.
+static size_t bench_nodes;
+static size_t bench_peak_nodes;
+
+static void bench_account_tape(void) {
+  bench_nodes += grad_reverse_current_id;
+  if (grad_reverse_current_id > bench_peak_nodes) {
+    bench_peak_nodes = grad_reverse_current_id;
+  }
+}
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+typedef double (*bench_fn_t)(size_t size);
+
+// Nanoseconds per call, repeating until bench_min_seconds has elapsed.
+static double bench_time(bench_fn_t fn, size_t size) {
+  size_t calls = 0;
+  double start = bench_now();
+  double elapsed = 0;
+  do {
+    bench_sink += fn(size);
+    calls += 1;
+    elapsed = bench_now() - start;
+  } while (elapsed < bench_min_seconds);
+  return elapsed * 1e9 / (double)calls;
+}
+
+// N-dimensional Rosenbrock
+
+static double plain_rosenbrock(size_t n) {
+  grad_real_t f = 0;
+  for (size_t i = 0; i + 1 < n; ++i) {
+    grad_real_t a = bench_input[i + 1] - bench_input[i] * bench_input[i];
+    grad_real_t b = 1 - bench_input[i];
+    f += 100 * a * a + b * b;
+  }
+  return f;
+}
+
+static double forward_rosenbrock(size_t n) {
+  grad_forward_t x[GRAD_FORWARD_TAPE_SIZE];
+  grad_forward_start_scope();
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = grad_forward_init(bench_input[i]);
+  }
+  grad_forward_t f = grad_forward_constant(0);
+  for (size_t i = 0; i + 1 < n; ++i) {
+    grad_forward_t sq = grad_forward_mul(&x[i], &x[i]);
+    grad_forward_t a = grad_forward_sub(&x[i + 1], &sq);
+    grad_forward_t a2 = grad_forward_mul(&a, &a);
+    grad_forward_t a3 = grad_forward_mul_c(&a2, 100);
+    grad_forward_t b = grad_forward_neg(&x[i]);
+    grad_forward_t b1 = grad_forward_add_c(&b, 1);
+    grad_forward_t b2 = grad_forward_mul(&b1, &b1);
+    grad_forward_t term = grad_forward_add(&a3, &b2);
+    f = grad_forward_add(&f, &term);
+  }
+  return f.derivative[0];
+}
+
+static double reverse_rosenbrock(size_t n) {
+  static grad_reverse_t *x[BENCH_MAX_INPUTS];
+  grad_reverse_start_scope();
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = grad_reverse_init(bench_input[i]);
+  }
+  grad_reverse_t *hundred = grad_reverse_init(100);
+  grad_reverse_t *one = grad_reverse_init(1);
+  grad_reverse_t *f = grad_reverse_init(0);
+  for (size_t i = 0; i + 1 < n; ++i) {
+    grad_reverse_t *a =
+        grad_reverse_sub(x[i + 1], grad_reverse_mul(x[i], x[i]));
+    grad_reverse_t *b = grad_reverse_sub(one, x[i]);
+    grad_reverse_t *term =
+        grad_reverse_add(grad_reverse_mul(hundred, grad_reverse_mul(a, a)),
+                         grad_reverse_mul(b, b));
+    f = grad_reverse_add(f, term);
+  }
+  grad_reverse_backward(f);
+  bench_account_tape();
+  return x[0]->derivative;
+}
+
+// Small MLP: 4 inputs, `hidden` tanh units, 1 linear output, squared loss
+// over a batch of 16 samples. Gradient w.r.t. all 6 * hidden + 1 weights.
+
+#define BENCH_MLP_INPUTS 4
+#define BENCH_MLP_BATCH 16
+
+static size_t mlp_params(size_t hidden) {
+  return hidden * BENCH_MLP_INPUTS + 2 * hidden + 1;
+}
+
+static double plain_mlp(size_t hidden) {
+  const grad_real_t *w = bench_input;
+  const grad_real_t *b = w + hidden * BENCH_MLP_INPUTS;
+  const grad_real_t *v = b + hidden;
+  grad_real_t c = v[hidden];
+  grad_real_t loss = 0;
+  for (size_t s = 0; s < BENCH_MLP_BATCH; ++s) {
+    const grad_real_t *sample = bench_input + 1024 + s * BENCH_MLP_INPUTS;
+    grad_real_t out = c;
+    for (size_t h = 0; h < hidden; ++h) {
+      grad_real_t z = b[h];
+      for (size_t i = 0; i < BENCH_MLP_INPUTS; ++i) {
+        z += w[h * BENCH_MLP_INPUTS + i] * sample[i];
+      }
+      out += v[h] * (1 - 2 / (GRAD_EXP(2 * z) + 1));
+    }
+    grad_real_t err = out - sample[0];
+    loss += err * err;
+  }
+  return loss;
+}
+
+static double forward_mlp(size_t hidden) {
+  size_t n = mlp_params(hidden);
+  grad_forward_t p[GRAD_FORWARD_TAPE_SIZE];
+  grad_forward_start_scope();
+  for (size_t i = 0; i < n; ++i) {
+    p[i] = grad_forward_init(bench_input[i]);
+  }
+  const grad_forward_t *w = p;
+  const grad_forward_t *b = w + hidden * BENCH_MLP_INPUTS;
+  const grad_forward_t *v = b + hidden;
+  grad_forward_t loss = grad_forward_constant(0);
+  for (size_t s = 0; s < BENCH_MLP_BATCH; ++s) {
+    const grad_real_t *sample = bench_input + 1024 + s * BENCH_MLP_INPUTS;
+    grad_forward_t out = v[hidden];
+    for (size_t h = 0; h < hidden; ++h) {
+      grad_forward_t z = b[h];
+      for (size_t i = 0; i < BENCH_MLP_INPUTS; ++i) {
+        grad_forward_t wx =
+            grad_forward_mul_c(&w[h * BENCH_MLP_INPUTS + i], sample[i]);
+        z = grad_forward_add(&z, &wx);
+      }
+      grad_forward_t z2 = grad_forward_mul_c(&z, 2);
+      grad_forward_t e = grad_forward_exp(&z2);
+      grad_forward_t e1 = grad_forward_add_c(&e, 1);
+      grad_forward_t r = grad_forward_inv(&e1);
+      grad_forward_t r2 = grad_forward_mul_c(&r, -2);
+      grad_forward_t t = grad_forward_add_c(&r2, 1);
+      grad_forward_t vt = grad_forward_mul(&v[h], &t);
+      out = grad_forward_add(&out, &vt);
+    }
+    grad_forward_t err = grad_forward_add_c(&out, -sample[0]);
+    grad_forward_t err2 = grad_forward_mul(&err, &err);
+    loss = grad_forward_add(&loss, &err2);
+  }
+  return loss.derivative[0];
+}
+
+static double reverse_mlp(size_t hidden) {
+  static grad_reverse_t *p[BENCH_MAX_INPUTS];
+  size_t n = mlp_params(hidden);
+  grad_reverse_start_scope();
+  for (size_t i = 0; i < n; ++i) {
+    p[i] = grad_reverse_init(bench_input[i]);
+  }
+  grad_reverse_t **w = p;
+  grad_reverse_t **b = w + hidden * BENCH_MLP_INPUTS;
+  grad_reverse_t **v = b + hidden;
+  grad_reverse_t *one = grad_reverse_init(1);
+  grad_reverse_t *two = grad_reverse_init(2);
+  grad_reverse_t *loss = grad_reverse_init(0);
+  for (size_t s = 0; s < BENCH_MLP_BATCH; ++s) {
+    const grad_real_t *sample = bench_input + 1024 + s * BENCH_MLP_INPUTS;
+    grad_reverse_t *out = v[hidden];
+    for (size_t h = 0; h < hidden; ++h) {
+      grad_reverse_t *z = b[h];
+      for (size_t i = 0; i < BENCH_MLP_INPUTS; ++i) {
+        grad_reverse_t *x = grad_reverse_init(sample[i]);
+        z = grad_reverse_add(z,
+                             grad_reverse_mul(w[h * BENCH_MLP_INPUTS + i], x));
+      }
+      grad_reverse_t *e = grad_reverse_exp(grad_reverse_mul(two, z));
+      grad_reverse_t *r = grad_reverse_div(two, grad_reverse_add(e, one));
+      grad_reverse_t *t = grad_reverse_sub(one, r);
+      out = grad_reverse_add(out, grad_reverse_mul(v[h], t));
+    }
+    grad_reverse_t *err =
+        grad_reverse_sub(out, grad_reverse_init(sample[0]));
+    loss = grad_reverse_add(loss, grad_reverse_mul(err, err));
+  }
+  grad_reverse_backward(loss);
+  bench_account_tape();
+  return p[0]->derivative;
+}
+
+// Black-Scholes call prices for `n` options, with delta, vega, rho and theta
+// of every option. The normal CDF is Abramowitz-Stegun 26.2.17.
+
+static grad_real_t plain_cdf(grad_real_t x) {
+  grad_real_t ax = x < 0 ? -x : x;
+  grad_real_t k = 1 / (1 + (grad_real_t)0.2316419 * ax);
+  grad_real_t poly =
+      k * ((grad_real_t)0.319381530 +
+           k * ((grad_real_t)-0.356563782 +
+                k * ((grad_real_t)1.781477937 +
+                     k * ((grad_real_t)-1.821255978 +
+                          k * (grad_real_t)1.330274429))));
+  grad_real_t tail =
+      (grad_real_t)0.3989422804 * GRAD_EXP(-ax * ax / 2) * poly;
+  return x < 0 ? tail : 1 - tail;
+}
+
+static double plain_blackscholes(size_t n) {
+  grad_real_t total = 0;
+  for (size_t o = 0; o < n; ++o) {
+    grad_real_t spot = 90 + bench_input[o % 64] * 20;
+    grad_real_t strike = 100;
+    grad_real_t t = (grad_real_t)0.5 + bench_input[(o + 1) % 64];
+    grad_real_t r = (grad_real_t)0.03;
+    grad_real_t sigma = (grad_real_t)0.2 + bench_input[(o + 2) % 64] / 10;
+    grad_real_t sqrt_t = GRAD_EXP(GRAD_LOG(t) / 2);
+    grad_real_t d1 =
+        (GRAD_LOG(spot / strike) + (r + sigma * sigma / 2) * t) /
+        (sigma * sqrt_t);
+    grad_real_t d2 = d1 - sigma * sqrt_t;
+    total += spot * plain_cdf(d1) -
+             strike * GRAD_EXP(-r * t) * plain_cdf(d2);
+  }
+  return total;
+}
+
+static grad_forward_t forward_cdf(const grad_forward_t *x) {
+  int negative = x->value < 0;
+  grad_forward_t ax = negative ? grad_forward_neg(x) : *x;
+  grad_forward_t k0 = grad_forward_mul_c(&ax, (grad_real_t)0.2316419);
+  grad_forward_t k1 = grad_forward_add_c(&k0, 1);
+  grad_forward_t k = grad_forward_inv(&k1);
+  static const grad_real_t coef[5] = {0.319381530, -0.356563782, 1.781477937,
+                                      -1.821255978, 1.330274429};
+  grad_forward_t poly = grad_forward_mul_c(&k, coef[4]);
+  for (int i = 3; i >= 0; --i) {
+    grad_forward_t shifted = grad_forward_add_c(&poly, coef[i]);
+    poly = grad_forward_mul(&k, &shifted);
+  }
+  grad_forward_t sq = grad_forward_mul(&ax, &ax);
+  grad_forward_t half = grad_forward_mul_c(&sq, -0.5);
+  grad_forward_t e = grad_forward_exp(&half);
+  grad_forward_t pe = grad_forward_mul(&e, &poly);
+  grad_forward_t tail = grad_forward_mul_c(&pe, (grad_real_t)0.3989422804);
+  if (negative) {
+    return tail;
+  }
+  grad_forward_t neg = grad_forward_neg(&tail);
+  return grad_forward_add_c(&neg, 1);
+}
+
+static double forward_blackscholes(size_t n) {
+  grad_real_t total = 0;
+  for (size_t o = 0; o < n; ++o) {
+    grad_forward_start_scope();
+    grad_forward_t spot = grad_forward_init(90 + bench_input[o % 64] * 20);
+    grad_forward_t t = grad_forward_init((grad_real_t)0.5 +
+                                         bench_input[(o + 1) % 64]);
+    grad_forward_t r = grad_forward_init((grad_real_t)0.03);
+    grad_forward_t sigma =
+        grad_forward_init((grad_real_t)0.2 + bench_input[(o + 2) % 64] / 10);
+    grad_real_t strike = 100;
+
+    grad_forward_t log_t = grad_forward_log(&t);
+    grad_forward_t half_log_t = grad_forward_mul_c(&log_t, 0.5);
+    grad_forward_t sqrt_t = grad_forward_exp(&half_log_t);
+    grad_forward_t moneyness = grad_forward_mul_c(&spot, 1 / strike);
+    grad_forward_t log_m = grad_forward_log(&moneyness);
+    grad_forward_t var = grad_forward_mul(&sigma, &sigma);
+    grad_forward_t half_var = grad_forward_mul_c(&var, 0.5);
+    grad_forward_t drift = grad_forward_add(&r, &half_var);
+    grad_forward_t drift_t = grad_forward_mul(&drift, &t);
+    grad_forward_t num = grad_forward_add(&log_m, &drift_t);
+    grad_forward_t vol = grad_forward_mul(&sigma, &sqrt_t);
+    grad_forward_t d1 = grad_forward_div(&num, &vol);
+    grad_forward_t d2 = grad_forward_sub(&d1, &vol);
+    grad_forward_t n1 = forward_cdf(&d1);
+    grad_forward_t n2 = forward_cdf(&d2);
+    grad_forward_t rt = grad_forward_mul(&r, &t);
+    grad_forward_t neg_rt = grad_forward_neg(&rt);
+    grad_forward_t disc = grad_forward_exp(&neg_rt);
+    grad_forward_t kd = grad_forward_mul_c(&disc, strike);
+    grad_forward_t a = grad_forward_mul(&spot, &n1);
+    grad_forward_t b = grad_forward_mul(&kd, &n2);
+    grad_forward_t price = grad_forward_sub(&a, &b);
+    total += price.derivative[0] + price.derivative[1] +
+             price.derivative[2] + price.derivative[3];
+  }
+  return total;
+}
+
+static grad_reverse_t *reverse_cdf(grad_reverse_t *x) {
+  static const grad_real_t coef[5] = {0.319381530, -0.356563782, 1.781477937,
+                                      -1.821255978, 1.330274429};
+  int negative = x->value < 0;
+  grad_reverse_t *ax = negative ? grad_reverse_neg(x) : x;
+  grad_reverse_t *one = grad_reverse_init(1);
+  grad_reverse_t *k = grad_reverse_inv(grad_reverse_add(
+      grad_reverse_mul(grad_reverse_init((grad_real_t)0.2316419), ax), one));
+  grad_reverse_t *poly = grad_reverse_mul(k, grad_reverse_init(coef[4]));
+  for (int i = 3; i >= 0; --i) {
+    poly = grad_reverse_mul(
+        k, grad_reverse_add(poly, grad_reverse_init(coef[i])));
+  }
+  grad_reverse_t *e = grad_reverse_exp(grad_reverse_mul(
+      grad_reverse_mul(ax, ax), grad_reverse_init((grad_real_t)-0.5)));
+  grad_reverse_t *tail = grad_reverse_mul(
+      grad_reverse_mul(e, poly), grad_reverse_init((grad_real_t)0.3989422804));
+  return negative ? tail : grad_reverse_sub(one, tail);
+}
+
+static double reverse_blackscholes(size_t n) {
+  grad_real_t total = 0;
+  for (size_t o = 0; o < n; ++o) {
+    grad_reverse_start_scope();
+    grad_reverse_t *spot = grad_reverse_init(90 + bench_input[o % 64] * 20);
+    grad_reverse_t *t =
+        grad_reverse_init((grad_real_t)0.5 + bench_input[(o + 1) % 64]);
+    grad_reverse_t *r = grad_reverse_init((grad_real_t)0.03);
+    grad_reverse_t *sigma =
+        grad_reverse_init((grad_real_t)0.2 + bench_input[(o + 2) % 64] / 10);
+    grad_reverse_t *strike = grad_reverse_init(100);
+    grad_reverse_t *half = grad_reverse_init(0.5);
+
+    grad_reverse_t *sqrt_t =
+        grad_reverse_exp(grad_reverse_mul(grad_reverse_log(t), half));
+    grad_reverse_t *drift = grad_reverse_add(
+        r, grad_reverse_mul(grad_reverse_mul(sigma, sigma), half));
+    grad_reverse_t *num = grad_reverse_add(
+        grad_reverse_log(grad_reverse_div(spot, strike)),
+        grad_reverse_mul(drift, t));
+    grad_reverse_t *vol = grad_reverse_mul(sigma, sqrt_t);
+    grad_reverse_t *d1 = grad_reverse_div(num, vol);
+    grad_reverse_t *d2 = grad_reverse_sub(d1, vol);
+    grad_reverse_t *disc =
+        grad_reverse_exp(grad_reverse_neg(grad_reverse_mul(r, t)));
+    grad_reverse_t *price = grad_reverse_sub(
+        grad_reverse_mul(spot, reverse_cdf(d1)),
+        grad_reverse_mul(grad_reverse_mul(strike, disc), reverse_cdf(d2)));
+    grad_reverse_backward(price);
+    bench_account_tape();
+    total += spot->derivative + t->derivative + r->derivative +
+             sigma->derivative;
+  }
+  return total;
+}
+
+// Lotka-Volterra integrated with `steps` fixed RK4 steps; gradient of the
+// final prey population w.r.t. the 4 parameters.
+
+#define BENCH_RK4_T 5.0
+
+static void plain_lv(const grad_real_t *p, const grad_real_t *y,
+                     grad_real_t *dy) {
+  dy[0] = p[0] * y[0] - p[1] * y[0] * y[1];
+  dy[1] = p[2] * y[0] * y[1] - p[3] * y[1];
+}
+
+static double plain_rk4(size_t steps) {
+  grad_real_t p[4] = {1.5, 1.0, 1.0, 3.0};
+  grad_real_t y[2] = {1, 1};
+  grad_real_t h = (grad_real_t)(BENCH_RK4_T / steps);
+  for (size_t s = 0; s < steps; ++s) {
+    grad_real_t k1[2], k2[2], k3[2], k4[2], tmp[2];
+    plain_lv(p, y, k1);
+    for (int i = 0; i < 2; ++i) tmp[i] = y[i] + h / 2 * k1[i];
+    plain_lv(p, tmp, k2);
+    for (int i = 0; i < 2; ++i) tmp[i] = y[i] + h / 2 * k2[i];
+    plain_lv(p, tmp, k3);
+    for (int i = 0; i < 2; ++i) tmp[i] = y[i] + h * k3[i];
+    plain_lv(p, tmp, k4);
+    for (int i = 0; i < 2; ++i) {
+      y[i] += h / 6 * (k1[i] + 2 * k2[i] + 2 * k3[i] + k4[i]);
+    }
+  }
+  return y[0];
+}
+
+static void forward_lv(const grad_forward_t *p, const grad_forward_t *y,
+                       grad_forward_t *dy) {
+  grad_forward_t xy = grad_forward_mul(&y[0], &y[1]);
+  grad_forward_t a = grad_forward_mul(&p[0], &y[0]);
+  grad_forward_t b = grad_forward_mul(&p[1], &xy);
+  grad_forward_t c = grad_forward_mul(&p[2], &xy);
+  grad_forward_t d = grad_forward_mul(&p[3], &y[1]);
+  dy[0] = grad_forward_sub(&a, &b);
+  dy[1] = grad_forward_sub(&c, &d);
+}
+
+static void forward_axpy(const grad_forward_t *y, const grad_forward_t *k,
+                         grad_real_t h, grad_forward_t *out) {
+  for (int i = 0; i < 2; ++i) {
+    grad_forward_t hk = grad_forward_mul_c(&k[i], h);
+    out[i] = grad_forward_add(&y[i], &hk);
+  }
+}
+
+static double forward_rk4(size_t steps) {
+  grad_forward_start_scope();
+  grad_forward_t p[4] = {grad_forward_init(1.5), grad_forward_init(1.0),
+                         grad_forward_init(1.0), grad_forward_init(3.0)};
+  grad_forward_t y[2] = {{0}, {0}};
+  y[0].value = 1;
+  y[1].value = 1;
+  grad_real_t h = (grad_real_t)(BENCH_RK4_T / steps);
+  for (size_t s = 0; s < steps; ++s) {
+    grad_forward_t k1[2], k2[2], k3[2], k4[2], tmp[2];
+    forward_lv(p, y, k1);
+    forward_axpy(y, k1, h / 2, tmp);
+    forward_lv(p, tmp, k2);
+    forward_axpy(y, k2, h / 2, tmp);
+    forward_lv(p, tmp, k3);
+    forward_axpy(y, k3, h, tmp);
+    forward_lv(p, tmp, k4);
+    for (int i = 0; i < 2; ++i) {
+      grad_forward_t k23 = grad_forward_add(&k2[i], &k3[i]);
+      grad_forward_t k23_2 = grad_forward_mul_c(&k23, 2);
+      grad_forward_t k14 = grad_forward_add(&k1[i], &k4[i]);
+      grad_forward_t sum = grad_forward_add(&k14, &k23_2);
+      grad_forward_t step = grad_forward_mul_c(&sum, h / 6);
+      y[i] = grad_forward_add(&y[i], &step);
+    }
+  }
+  return y[0].derivative[0];
+}
+
+static void reverse_lv(grad_reverse_t *const *p, grad_reverse_t *const *y,
+                       grad_reverse_t **dy) {
+  grad_reverse_t *xy = grad_reverse_mul(y[0], y[1]);
+  dy[0] = grad_reverse_sub(grad_reverse_mul(p[0], y[0]),
+                           grad_reverse_mul(p[1], xy));
+  dy[1] = grad_reverse_sub(grad_reverse_mul(p[2], xy),
+                           grad_reverse_mul(p[3], y[1]));
+}
+
+static void reverse_axpy(grad_reverse_t *const *y, grad_reverse_t *const *k,
+                         grad_reverse_t *h, grad_reverse_t **out) {
+  for (int i = 0; i < 2; ++i) {
+    out[i] = grad_reverse_add(y[i], grad_reverse_mul(k[i], h));
+  }
+}
+
+static double reverse_rk4(size_t steps) {
+  grad_reverse_start_scope();
+  grad_reverse_t *p[4] = {grad_reverse_init(1.5), grad_reverse_init(1.0),
+                          grad_reverse_init(1.0), grad_reverse_init(3.0)};
+  grad_reverse_t *y[2] = {grad_reverse_init(1), grad_reverse_init(1)};
+  grad_real_t step = (grad_real_t)(BENCH_RK4_T / steps);
+  grad_reverse_t *h = grad_reverse_init(step);
+  grad_reverse_t *h2 = grad_reverse_init(step / 2);
+  grad_reverse_t *h6 = grad_reverse_init(step / 6);
+  grad_reverse_t *two = grad_reverse_init(2);
+  for (size_t s = 0; s < steps; ++s) {
+    grad_reverse_t *k1[2], *k2[2], *k3[2], *k4[2], *tmp[2];
+    reverse_lv(p, y, k1);
+    reverse_axpy(y, k1, h2, tmp);
+    reverse_lv(p, tmp, k2);
+    reverse_axpy(y, k2, h2, tmp);
+    reverse_lv(p, tmp, k3);
+    reverse_axpy(y, k3, h, tmp);
+    reverse_lv(p, tmp, k4);
+    for (int i = 0; i < 2; ++i) {
+      grad_reverse_t *sum = grad_reverse_add(
+          grad_reverse_add(k1[i], k4[i]),
+          grad_reverse_mul(grad_reverse_add(k2[i], k3[i]), two));
+      y[i] = grad_reverse_add(y[i], grad_reverse_mul(sum, h6));
+    }
+  }
+  grad_reverse_backward(y[0]);
+  bench_account_tape();
+  return p[0]->derivative;
+}
+
+// Tridiagonal residual F_i = x_{i-1} x_i + sin(x_{i+1}); full Jacobian.
+// Forward mode uses 3-colour compression, reverse mode one sweep per row.
+
+static double plain_sparse(size_t n) {
+  grad_real_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    grad_real_t left = i > 0 ? bench_input[i - 1] : 0;
+    grad_real_t right = i + 1 < n ? bench_input[i + 1] : 0;
+    total += left * bench_input[i] + GRAD_SIN(right);
+  }
+  return total;
+}
+
+static double forward_sparse(size_t n) {
+  static grad_forward_t x[BENCH_MAX_INPUTS];
+  grad_real_t total = 0;
+  grad_forward_start_scope();
+  grad_forward_current_id = 3;
+  for (size_t i = 0; i < n; ++i) {
+    memset(&x[i], 0, sizeof(grad_forward_t));
+    x[i].value = bench_input[i];
+    x[i].derivative[i % 3] = 1;
+  }
+  grad_forward_t zero = grad_forward_constant(0);
+  for (size_t i = 0; i < n; ++i) {
+    const grad_forward_t *left = i > 0 ? &x[i - 1] : &zero;
+    const grad_forward_t *right = i + 1 < n ? &x[i + 1] : &zero;
+    grad_forward_t a = grad_forward_mul(left, &x[i]);
+    grad_forward_t b = grad_forward_sin(right);
+    grad_forward_t f = grad_forward_add(&a, &b);
+    total += f.derivative[0] + f.derivative[1] + f.derivative[2];
+  }
+  return total;
+}
+
+static double reverse_sparse(size_t n) {
+  static grad_reverse_t *x[BENCH_MAX_INPUTS];
+  static grad_reverse_t *f[BENCH_MAX_INPUTS];
+  grad_real_t total = 0;
+  grad_reverse_start_scope();
+  for (size_t i = 0; i < n; ++i) {
+    x[i] = grad_reverse_init(bench_input[i]);
+  }
+  grad_reverse_t *zero = grad_reverse_init(0);
+  for (size_t i = 0; i < n; ++i) {
+    grad_reverse_t *left = i > 0 ? x[i - 1] : zero;
+    grad_reverse_t *right = i + 1 < n ? x[i + 1] : zero;
+    f[i] = grad_reverse_add(grad_reverse_mul(left, x[i]),
+                            grad_reverse_sin(right));
+  }
+  for (size_t i = 0; i < n; ++i) {
+    grad_reverse_backward(f[i]);
+    total += x[i]->derivative;
+  }
+  bench_account_tape();
+  return total;
+}
+
+typedef struct bench_workload_t {
+  const char *name;
+  bench_fn_t plain;
+  bench_fn_t forward;
+  bench_fn_t reverse;
+  // Number of forward-mode inputs at a size; forward mode is skipped when
+  // it exceeds GRAD_FORWARD_TAPE_SIZE.
+  size_t (*forward_inputs)(size_t size);
+  size_t sizes[4];
+} bench_workload_t;
+
+static size_t inputs_identity(size_t size) { return size; }
+static size_t inputs_four(size_t size) { return (void)size, 4; }
+static size_t inputs_three(size_t size) { return (void)size, 3; }
+
+static const bench_workload_t bench_workloads[] = {
+    {"rosenbrock", plain_rosenbrock, forward_rosenbrock, reverse_rosenbrock,
+     inputs_identity, {16, 64, 1024, 16384}},
+    {"mlp", plain_mlp, forward_mlp, reverse_mlp, mlp_params, {2, 8, 32, 128}},
+    {"black_scholes", plain_blackscholes, forward_blackscholes,
+     reverse_blackscholes, inputs_four, {16, 256, 4096, 0}},
+    {"rk4_ode", plain_rk4, forward_rk4, reverse_rk4, inputs_four,
+     {10, 100, 1000, 10000}},
+    {"sparse_jacobian", plain_sparse, forward_sparse, reverse_sparse,
+     inputs_three, {16, 128, 512, 0}},
+};
+
+#ifdef GRAD_PERF
+#define BENCH_PERF_REPEAT 16
+#define BENCH_PERF_OP_NODES 65536
+
+static const char *bench_perf_names[GRAD_PERF_COUNT] = {
+    "cycles",       "instructions",  "l1d_misses",
+    "llc_misses",   "branch_misses", "dtlb_misses",
+};
+
+static void bench_perf_phase(const char *phase,
+                             const unsigned long long *counts, size_t nodes,
+                             unsigned available) {
+  printf("\"%s\": {", phase);
+  int first = 1;
+  for (size_t c = 0; c < GRAD_PERF_COUNT; ++c) {
+    if (available & (1u << c)) {
+      printf("%s\"%s_per_node\": %.4g", first ? "" : ", ",
+             bench_perf_names[c],
+             nodes ? (double)counts[c] / (double)nodes : 0.0);
+      first = 0;
+    }
+  }
+  printf("}");
+}
+
+static void bench_perf_report(void) {
+  grad_perf_t perf = grad_perf_get();
+  printf("{");
+  bench_perf_phase("record", perf.record, perf.record_nodes, perf.available);
+  printf(", ");
+  bench_perf_phase("backward", perf.backward, perf.backward_nodes,
+                   perf.available);
+  printf("}");
+}
+
+static void bench_perf_workload(bench_fn_t reverse, size_t size) {
+  grad_perf_reset();
+  for (size_t r = 0; r < BENCH_PERF_REPEAT; ++r) {
+    bench_sink += reverse(size);
+  }
+  // Close the record phase of the last scope.
+  grad_reverse_start_scope();
+  printf(", \"perf\": ");
+  bench_perf_report();
+}
+
+// Tape of BENCH_PERF_OP_NODES nodes of one op kind, each applied to a leaf.
+static void bench_perf_ops(void) {
+  static const char *names[GRAD_OP_COUNT] = {"none", "add", "mul", "neg",
+                                             "inv",  "sin", "cos", "exp",
+                                             "log"};
+  printf(",\n  \"per_op\": [");
+  for (int op = GRAD_OP_ADD; op <= GRAD_OP_LOG; ++op) {
+    grad_perf_reset();
+    for (size_t r = 0; r < BENCH_PERF_REPEAT; ++r) {
+      grad_reverse_start_scope();
+      grad_reverse_t *x = grad_reverse_init((grad_real_t)0.5);
+      grad_reverse_t *y = x;
+      for (size_t i = 0; i < BENCH_PERF_OP_NODES; ++i) {
+        switch (op) {
+        case GRAD_OP_ADD: y = grad_reverse_add(x, x); break;
+        case GRAD_OP_MUL: y = grad_reverse_mul(x, x); break;
+        case GRAD_OP_NEG: y = grad_reverse_neg(x); break;
+        case GRAD_OP_INV: y = grad_reverse_inv(x); break;
+        case GRAD_OP_SIN: y = grad_reverse_sin(x); break;
+        case GRAD_OP_COS: y = grad_reverse_cos(x); break;
+        case GRAD_OP_EXP: y = grad_reverse_exp(x); break;
+        default: y = grad_reverse_log(x); break;
+        }
+      }
+      grad_reverse_backward(y);
+    }
+    printf("%s\n    {\"op\": \"%s\", \"perf\": ",
+           op == GRAD_OP_ADD ? "" : ",", names[op]);
+    bench_perf_report();
+    printf("}");
+  }
+  printf("\n  ]");
+}
+#endif // GRAD_PERF
+
+static void bench_report(int *first, const char *workload, const char *mode,
+                         size_t size, double ns, double plain_ns,
+                         size_t nodes, size_t peak_nodes, bench_fn_t reverse) {
+  int has_tape = reverse != NULL;
+  printf("%s\n    {\"workload\": \"%s\", \"mode\": \"%s\", \"size\": %zu, "
+         "\"ns_per_op\": %.1f, \"nodes\": %zu, \"nodes_per_s\": %.4g, ",
+         *first ? "" : ",", workload, mode, size, ns, nodes,
+         (double)nodes / (ns * 1e-9));
+  if (has_tape) {
+    printf("\"peak_tape_bytes\": %zu, ",
+           peak_nodes * sizeof(grad_reverse_t));
+  } else {
+    printf("\"peak_tape_bytes\": null, ");
+  }
+  printf("\"grad_to_function_ratio\": %.2f", ns / plain_ns);
+#ifdef GRAD_PERF
+  if (has_tape) {
+    bench_perf_workload(reverse, size);
+  }
+#endif // GRAD_PERF
+  printf("}");
+  *first = 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    bench_min_seconds = atof(argv[1]) / 1000;
+  }
+  srand(1);
+  for (size_t i = 0; i < BENCH_MAX_INPUTS; ++i) {
+    bench_input[i] = (grad_real_t)rand() / RAND_MAX;
+  }
+
+#ifdef GRAD_PERF
+  unsigned available = grad_perf_open();
+  if (available == 0) {
+    fprintf(stderr, "perf_event_open unavailable; counters will be empty\n");
+  }
+#endif // GRAD_PERF
+
+  printf("{\n  \"real\": \"%s\",\n  \"forward_tape_size\": %d,\n"
+         "  \"reverse_tape_size\": %d,\n  \"reverse_node_bytes\": %zu,\n"
+         "  \"results\": [",
+         sizeof(grad_real_t) == sizeof(double) ? "double" : "float",
+         GRAD_FORWARD_TAPE_SIZE, GRAD_REVERSE_TAPE_SIZE,
+         sizeof(grad_reverse_t));
+
+  int first = 1;
+  size_t count = sizeof(bench_workloads) / sizeof(bench_workloads[0]);
+  for (size_t w = 0; w < count; ++w) {
+    const bench_workload_t *work = &bench_workloads[w];
+    for (size_t s = 0; s < 4 && work->sizes[s]; ++s) {
+      size_t size = work->sizes[s];
+      double plain_ns = bench_time(work->plain, size);
+
+      // Node count of the recorded graph; forward mode executes the same
+      // operations without keeping them.
+      bench_nodes = 0;
+      bench_peak_nodes = 0;
+      work->reverse(size);
+      size_t nodes = bench_nodes;
+      size_t peak_nodes = bench_peak_nodes;
+
+      double reverse_ns = bench_time(work->reverse, size);
+      bench_report(&first, work->name, "reverse", size, reverse_ns, plain_ns,
+                   nodes, peak_nodes, work->reverse);
+      if (work->forward_inputs(size) <= GRAD_FORWARD_TAPE_SIZE) {
+        double forward_ns = bench_time(work->forward, size);
+        bench_report(&first, work->name, "forward", size, forward_ns,
+                     plain_ns, nodes, peak_nodes, NULL);
+      }
+    }
+  }
+  printf("\n  ]");
+#ifdef GRAD_PERF
+  bench_perf_ops();
+  grad_perf_close();
+#endif // GRAD_PERF
+  printf("\n}\n");
+  return 0;
+}
@@ -0,0 +1,56 @@
+#define GRAD_IMPLEMENTATION
+#include "grad.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PROBLEMS 1000000
+
+// x^3 - a x + 3 for a different a per problem, so lanes converge after very
+// different numbers of steps.
+static void residual(const grad_forward_batch_t *x, const size_t *problem,
+                     grad_forward_batch_t *f, void *user) {
+  const grad_real_t *a = user;
+  grad_forward_batch_t coefficient = grad_forward_batch_constant(0);
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    if (problem[l] != GRAD_NEWTON_IDLE) {
+      coefficient.value[l] = a[problem[l]];
+    }
+  }
+  grad_forward_batch_t ax = grad_forward_batch_mul(&coefficient, x);
+  grad_forward_batch_t cube = grad_forward_batch_pow(x, 3);
+  grad_forward_batch_t s = grad_forward_batch_sub(&cube, &ax);
+  *f = grad_forward_batch_add_c(&s, 3);
+}
+
+int main(void) {
+  srand((unsigned)time(NULL));
+  grad_real_t *a = malloc(sizeof(grad_real_t) * PROBLEMS);
+  grad_real_t *x = malloc(sizeof(grad_real_t) * PROBLEMS);
+  size_t *iterations = malloc(sizeof(size_t) * PROBLEMS);
+  for (size_t i = 0; i < PROBLEMS; i++) {
+    a[i] = ((grad_real_t)rand() / RAND_MAX) * 10.0;
+    x[i] = -3;
+  }
+
+  clock_t start = clock();
+  grad_newton_batch_t report =
+      grad_newton_batch(residual, a, PROBLEMS, x, 1e-6, 100, iterations);
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  size_t most = 0;
+  for (size_t i = 0; i < PROBLEMS; i++) {
+    most = iterations[i] > most ? iterations[i] : most;
+  }
+  printf("Converged: %zu / %d in %.3f s\n", report.converged, PROBLEMS,
+         seconds);
+  printf("Most steps: %zu, lane utilisation: %.1f%%\n", most,
+         100.0 * (double)report.lane_steps /
+             ((double)report.sweeps * GRAD_FORWARD_BATCH_WIDTH));
+  printf("Root of problem 0 (a = %f): %f\n", a[0], x[0]);
+
+  free(a);
+  free(x);
+  free(iterations);
+}
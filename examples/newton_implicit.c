@@ -0,0 +1,36 @@
+#define GRAD_IMPLEMENTATION
+#include "grad.h"
+#include <stdio.h>
+
+// −x^2 + px + 3
+static void residual(grad_reverse_t *const *x, grad_reverse_t *const *p,
+                     grad_reverse_t **out, void *user) {
+  (void)user;
+  // -x^2
+  grad_reverse_t *s1 = grad_reverse_neg(grad_reverse_mul(x[0], x[0]));
+  // px
+  grad_reverse_t *s2 = grad_reverse_mul(p[0], x[0]);
+  // -x^2 + px + 3
+  out[0] = grad_reverse_add(grad_reverse_add(s1, s2), grad_reverse_init(3));
+}
+
+int main(void) {
+  grad_implicit_t solve = {0};
+  solve.kind = GRAD_IMPLICIT_ROOT;
+  solve.fn = residual;
+  solve.state_size = 1;
+  solve.param_size = 1;
+  solve.tol = 1e-6;
+  solve.max_iter = 1000;
+
+  grad_real_t p = 6;
+  grad_real_t x = 10;
+  grad_implicit_solve(&solve, &x, &p);
+  printf("Root found: %f after %zu steps\n", x, solve.iterations);
+
+  // dx/dp from the implicit function theorem, without taping the iterations
+  grad_real_t x_bar = 1;
+  grad_real_t p_bar;
+  grad_implicit_vjp(&solve, &x, &p, &x_bar, &p_bar);
+  printf("dx/dp: %f (expected %f)\n", p_bar, -x / (p - 2 * x));
+}
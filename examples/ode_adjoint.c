@@ -0,0 +1,77 @@
+#define GRAD_IMPLEMENTATION
+#include "grad.h"
+#include <stdio.h>
+
+// Lotka-Volterra: x' = a x - b x y, y' = d x y - g y
+static void lotka_volterra(grad_real_t t, grad_reverse_t *const *y,
+                           grad_reverse_t *const *p, grad_reverse_t **dydt,
+                           void *user) {
+  (void)t;
+  (void)user;
+  grad_reverse_t *xy = grad_reverse_mul(y[0], y[1]);
+  dydt[0] = grad_reverse_sub(grad_reverse_mul(p[0], y[0]),
+                             grad_reverse_mul(p[1], xy));
+  dydt[1] = grad_reverse_sub(grad_reverse_mul(p[2], xy),
+                             grad_reverse_mul(p[3], y[1]));
+}
+
+// x(5) from y0 and p, for the central-difference check
+static grad_real_t final_x(grad_ode_t *ode, const grad_real_t *y0,
+                           const grad_real_t *p) {
+  grad_real_t y[2] = {y0[0], y0[1]};
+  grad_ode_solve(ode, 0, 5, y, p);
+  return y[0];
+}
+
+int main(void) {
+  grad_ode_t ode = {0};
+  ode.rhs = lotka_volterra;
+  ode.state_size = 2;
+  ode.param_size = 4;
+  ode.rtol = 1e-6;
+  ode.atol = 1e-6;
+  ode.max_steps = 10000;
+
+  grad_real_t p[4] = {1.5, 1.0, 1.0, 3.0};
+  grad_real_t y[2] = {1.0, 1.0};
+
+  grad_reverse_start_scope();
+  grad_ode_solve(&ode, 0, 5, y, p);
+  printf("y(5) = (%f, %f) in %zu steps\n", y[0], y[1], ode.steps);
+
+  // L = x(5), so dL/dy(5) = (1, 0)
+  grad_real_t y1_bar[2] = {1, 0};
+  grad_real_t y0_bar[2];
+  grad_real_t p_bar[4];
+  grad_ode_adjoint(&ode, p, y1_bar, y0_bar, p_bar);
+
+  grad_real_t y0[2] = {1.0, 1.0};
+  grad_real_t h = 1e-3;
+  grad_real_t y0_fd[2];
+  grad_real_t p_fd[4];
+  for (size_t i = 0; i < 2; ++i) {
+    grad_real_t saved = y0[i];
+    y0[i] = saved + h;
+    grad_real_t plus = final_x(&ode, y0, p);
+    y0[i] = saved - h;
+    grad_real_t minus = final_x(&ode, y0, p);
+    y0[i] = saved;
+    y0_fd[i] = (plus - minus) / (2 * h);
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    grad_real_t saved = p[i];
+    p[i] = saved + h;
+    grad_real_t plus = final_x(&ode, y0, p);
+    p[i] = saved - h;
+    grad_real_t minus = final_x(&ode, y0, p);
+    p[i] = saved;
+    p_fd[i] = (plus - minus) / (2 * h);
+  }
+
+  printf("dL/dy0 = (%f, %f) (expected (%f, %f))\n", y0_bar[0], y0_bar[1],
+         y0_fd[0], y0_fd[1]);
+  printf("dL/dp  = (%f, %f, %f, %f)\n", p_bar[0], p_bar[1], p_bar[2],
+         p_bar[3]);
+  printf("  expected (%f, %f, %f, %f)\n", p_fd[0], p_fd[1], p_fd[2],
+         p_fd[3]);
+}
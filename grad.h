@@ -28,6 +28,13 @@ cc -lm -o grad grad.c
 ./grad
 ```
 
+Each `grad_forward_t` carries the range of input ids its derivative may depend
+on (`active_begin`, `active_end`) and ops only do tangent work inside it.
+`grad_forward_init` covers its own id and `grad_forward_constant` makes a
+passive value with no tangent work at all. A zero-initialised value, such as
+an accumulator or one whose `derivative` is filled by hand, counts as
+depending on every input.
+
 ### Reverse Mode
 
 ```c
@@ -55,6 +62,13 @@ cc -lm -o grad grad.c
 
 All these macros are `#define`d by the user before including grad.h
 
+`GRAD_STATS`, `GRAD_SOURCE_PROFILE`, `GRAD_TRACE`, `GRAD_TUNE`,
+`GRAD_METRICS_SHM`, `GRAD_PERF` and `GRAD_DATASET` use POSIX and BSD calls
+that strict `-std=c11` hides. The implementation defines `_DEFAULT_SOURCE` for
+them, which only takes effect when grad.h is the first include of that
+translation unit; otherwise define `_DEFAULT_SOURCE` (or use a gnu dialect)
+yourself or compilation stops with an `#error`.
+
 ### Flags
 
 Enable or disable certain aspects of grad.h
@@ -64,6 +78,42 @@ declarations are included. See
 https://github.com/nothings/stb/blob/f58f558c120e9b32c217290b80bad1a0729fbb2c/docs/stb_howto.txt
   for more info.
 - `GRAD_USE_DOUBLE` - use double precision for all computation (default float)
+- `GRAD_STATS` - Collect tape statistics queryable with `grad_stats_get`: nodes
+per op in the current reverse scope, peak `grad_reverse_current_id` and
+`grad_forward_current_id`, bytes moved by record and backward, and sampled
+backward time per op. Compiled out entirely by default.
+- `GRAD_TRACE` - Timestamp reverse scopes, recording, backward and each sweep
+into lock-free per-thread ring buffers. `grad_trace_begin` / `grad_trace_end`
+add user spans and `grad_trace_dump` writes Chrome trace JSON that loads in
+Perfetto. Requires C11 atomics and thread-local storage.
+- `GRAD_PERF` - Linux only. `grad_perf_open` opens a `perf_event_open` counter
+group (cycles, instructions, L1D/LLC misses, branch mispredictions, dTLB
+misses) and `grad_perf_get` reports counts for the record phase and for
+`grad_reverse_backward`, with the nodes each covered.
+- `GRAD_SOURCE_PROFILE` - Make the `grad_reverse_*` recording functions macros
+that capture `__FILE__`/`__LINE__` per node. Node counts, sampled backward
+time and adjoint magnitudes are aggregated per source line;
+`grad_source_profile_dump` prints a flat profile.
+- `GRAD_THREADS` - Back `grad_parallel_for` with a pthread pool started by
+`grad_threads_start`, used by `grad_reverse_replay_schedule` to evaluate the
+ops of each dependency level in parallel. Link with `-lpthread`. Without it
+everything runs on the calling thread.
+- `GRAD_TUNE` - On first use, time the forward replay, second-order sweep and
+primal replay kernels on private buffers, pick replay and HVP lane counts
+and the parallel grain, and save them to `GRAD_TUNE_FILE` for later runs.
+With `GRAD_THREADS` the pool size is also timed at powers of two up to the
+CPU count; otherwise it is the CPU count. `grad_tune_get` returns the
+choices; `grad_tune_run` re-measures.
+- `GRAD_METRICS_SHM` - POSIX only. `grad_metrics_open` maps a shared-memory
+segment that tape, backward and thread pool hooks update with relaxed
+atomics: tapes started, backward count and latency histogram, peak tape size
+and pool busy time. `tools/grad_metrics.c` reads it from another process.
+The segment outlives the process; remove it with `grad_metrics_unlink`.
+- `GRAD_DATASET` - POSIX only. `grad_dataset_open` memory-maps a file of
+fixed-size binary samples and `grad_dataset_accumulate` records a loss per
+chunk of samples into a fresh scope with the parameters bound, summing
+their gradients. Tape and resident file memory stay at about one chunk
+whatever the dataset size.
 
 ### Redefinable Macros
 
@@ -75,12 +125,68 @@ function. (default 64)
 - `GRAD_REVERSE_TAPE_SIZE` - Maximum number of nodes allowed in the reverse-mode
 computation graph ("tape"). Must be greather than the total number of operations
 performed during forward pass. (default 64)
+- `GRAD_ODE_MAX_STATE` - Maximum state dimension of an ODE passed to
+`grad_ode_solve`. (default 16)
+- `GRAD_ODE_MAX_PARAMS` - Maximum number of parameters of an ODE. (default 16)
+- `GRAD_ODE_CHECKPOINTS` - Number of evenly spaced states `grad_ode_solve`
+stores for the adjoint solve. Memory does not depend on the step count.
+(default 16)
+- `GRAD_IMPLICIT_MAX_STATE` - Maximum number of unknowns of a solve passed to
+`grad_implicit_solve`. (default 16)
+- `GRAD_IMPLICIT_MAX_PARAMS` - Maximum number of parameters of an implicit
+solve. (default 16)
+- `GRAD_HVP_LANES` - Number of directions pushed through the tape per
+Hessian-vector product sweep, and the batch size of Hutchinson probes.
+`GRAD_TUNE` may pick fewer. (default 8)
+- `GRAD_STATS_SAMPLE_PERIOD` - With `GRAD_STATS` or `GRAD_SOURCE_PROFILE`, time
+one in this many nodes during backward. (default 64)
+- `GRAD_TRACE_RING_SIZE` - With `GRAD_TRACE`, events kept per thread before
+the oldest are overwritten. (default 65536)
+- `GRAD_SOURCE_PROFILE_SIZE` - With `GRAD_SOURCE_PROFILE`, number of distinct
+source lines tracked. Later lines are counted as `<unknown>`. (default 256)
+- `GRAD_REMAT_MAX_COST` - Largest estimated cost, in ADDs, of the op chain
+`grad_reverse_remat_plan` may recompute for one value during backward.
+(default 32)
+- `GRAD_PARALLEL_GRAIN` - Smallest number of ops per task when
+`grad_reverse_replay_schedule` splits a level across threads; narrower
+levels run on the calling thread. Replaced by the measured grain under
+`GRAD_TUNE`. (default 1024)
+- `GRAD_THREADS_MAX` - With `GRAD_THREADS`, maximum size of the thread pool.
+(default 64)
+- `GRAD_FORWARD_RECORD_SIZE` - Maximum number of inputs and ops captured
+between `grad_forward_record_start` and `grad_forward_record_stop`.
+(default 1024)
+- `GRAD_FORWARD_REPLAY_LANES` - Number of seed directions `grad_forward_replay`
+pushes through the recording per pass. `GRAD_TUNE` may pick fewer.
+(default 8)
+- `GRAD_REVERSE_BINDINGS` - Maximum number of `grad_reverse_bind` blocks per
+reverse scope. (default 16)
+- `GRAD_TUNE_FILE` - With `GRAD_TUNE`, path of the saved profile.
+(default ".grad_tune")
+- `GRAD_FORWARD_BATCH_WIDTH` - Number of lanes in a `grad_forward_batch_t`,
+and so the number of problems `grad_newton_batch` advances per evaluation.
+Match it to the SIMD width times the unroll you want. (default 8)
+- `GRAD_MONTE_CARLO_BLOCK` - Paths per `grad_monte_carlo` task. Each task
+copies the tape once and keeps its own running statistics, merged in block
+order. (default 256)
+- `GRAD_DATASET_PREFETCH` - With `GRAD_DATASET`, number of chunks
+`grad_dataset_accumulate` asks the kernel to read ahead. (default 2)
 
 */
 
 #ifndef GRAD_H_
 #define GRAD_H_
 
+#if defined(GRAD_IMPLEMENTATION) &&                                            \
+    (defined(GRAD_STATS) || defined(GRAD_SOURCE_PROFILE) ||                    \
+     defined(GRAD_TRACE) || defined(GRAD_TUNE) || defined(GRAD_METRICS_SHM) || \
+     defined(GRAD_PERF) || defined(GRAD_DATASET)) &&                           \
+    !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE) &&                    \
+    !defined(_DEFAULT_SOURCE) && !defined(_GNU_SOURCE)
+// clock_gettime, shm_open, madvise and syscall are hidden under -std=c11.
+#define _DEFAULT_SOURCE
+#endif
+
 #ifdef GRAD_USE_DOUBLE
 typedef double grad_real_t;
 #define GRAD_EXP exp
@@ -99,6 +205,7 @@ typedef float grad_real_t;
 #define GRAD_POW powf
 #endif
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifndef GRAD_FORWARD_TAPE_SIZE
@@ -109,6 +216,82 @@ typedef float grad_real_t;
 #define GRAD_REVERSE_TAPE_SIZE 64
 #endif // GRAD_REVERSE_TAPE_SIZE
 
+#ifndef GRAD_FORWARD_RECORD_SIZE
+#define GRAD_FORWARD_RECORD_SIZE 1024
+#endif // GRAD_FORWARD_RECORD_SIZE
+
+#ifndef GRAD_FORWARD_REPLAY_LANES
+#define GRAD_FORWARD_REPLAY_LANES 8
+#endif // GRAD_FORWARD_REPLAY_LANES
+
+#ifndef GRAD_FORWARD_BATCH_WIDTH
+#define GRAD_FORWARD_BATCH_WIDTH 8
+#endif // GRAD_FORWARD_BATCH_WIDTH
+
+#ifndef GRAD_MONTE_CARLO_BLOCK
+#define GRAD_MONTE_CARLO_BLOCK 256
+#endif // GRAD_MONTE_CARLO_BLOCK
+
+#ifndef GRAD_DATASET_PREFETCH
+#define GRAD_DATASET_PREFETCH 2
+#endif // GRAD_DATASET_PREFETCH
+
+#ifndef GRAD_REVERSE_BINDINGS
+#define GRAD_REVERSE_BINDINGS 16
+#endif // GRAD_REVERSE_BINDINGS
+
+#ifndef GRAD_ODE_MAX_STATE
+#define GRAD_ODE_MAX_STATE 16
+#endif // GRAD_ODE_MAX_STATE
+
+#ifndef GRAD_ODE_MAX_PARAMS
+#define GRAD_ODE_MAX_PARAMS 16
+#endif // GRAD_ODE_MAX_PARAMS
+
+#ifndef GRAD_ODE_CHECKPOINTS
+#define GRAD_ODE_CHECKPOINTS 16
+#endif // GRAD_ODE_CHECKPOINTS
+
+#ifndef GRAD_IMPLICIT_MAX_STATE
+#define GRAD_IMPLICIT_MAX_STATE 16
+#endif // GRAD_IMPLICIT_MAX_STATE
+
+#ifndef GRAD_IMPLICIT_MAX_PARAMS
+#define GRAD_IMPLICIT_MAX_PARAMS 16
+#endif // GRAD_IMPLICIT_MAX_PARAMS
+
+#ifndef GRAD_HVP_LANES
+#define GRAD_HVP_LANES 8
+#endif // GRAD_HVP_LANES
+
+#ifndef GRAD_STATS_SAMPLE_PERIOD
+#define GRAD_STATS_SAMPLE_PERIOD 64
+#endif // GRAD_STATS_SAMPLE_PERIOD
+
+#ifndef GRAD_TRACE_RING_SIZE
+#define GRAD_TRACE_RING_SIZE 65536
+#endif // GRAD_TRACE_RING_SIZE
+
+#ifndef GRAD_PARALLEL_GRAIN
+#define GRAD_PARALLEL_GRAIN 1024
+#endif // GRAD_PARALLEL_GRAIN
+
+#ifndef GRAD_THREADS_MAX
+#define GRAD_THREADS_MAX 64
+#endif // GRAD_THREADS_MAX
+
+#ifndef GRAD_TUNE_FILE
+#define GRAD_TUNE_FILE ".grad_tune"
+#endif // GRAD_TUNE_FILE
+
+#ifndef GRAD_REMAT_MAX_COST
+#define GRAD_REMAT_MAX_COST 32
+#endif // GRAD_REMAT_MAX_COST
+
+#ifndef GRAD_SOURCE_PROFILE_SIZE
+#define GRAD_SOURCE_PROFILE_SIZE 256
+#endif // GRAD_SOURCE_PROFILE_SIZE
+
 typedef struct grad_reverse_t grad_reverse_t;
 typedef struct grad_forward_t grad_forward_t;
 
@@ -122,6 +305,8 @@ typedef enum grad_reverse_op_t {
   GRAD_OP_COS,
   GRAD_OP_EXP,
   GRAD_OP_LOG,
+  GRAD_OP_BLACKBOX,
+  GRAD_OP_COUNT,
 } grad_reverse_op_t;
 
 struct grad_reverse_t {
@@ -133,15 +318,51 @@ struct grad_reverse_t {
   grad_reverse_t *right;
 };
 
+// Spelled with _Complex so grad.h never includes <complex.h>. Compilers
+// without C99 complex get a placeholder and complex_fn must stay NULL.
+#ifndef __STDC_NO_COMPLEX__
+#ifdef GRAD_USE_DOUBLE
+typedef double _Complex grad_complex_t;
+#else
+typedef float _Complex grad_complex_t;
+#endif
+#else
+typedef struct grad_complex_t {
+  grad_real_t parts[2];
+} grad_complex_t;
+#endif // __STDC_NO_COMPLEX__
+
+// Opaque function of `inputs` values to `outputs` values, differentiated
+// numerically. Set fn for central differences or complex_fn, which must be
+// analytic in its inputs, for the complex step. Either may be called from
+// several threads at once.
+typedef struct grad_blackbox_t {
+  size_t inputs;
+  size_t outputs;
+  void (*fn)(const grad_real_t *x, grad_real_t *y, void *user);
+  void (*complex_fn)(const grad_complex_t *x, grad_complex_t *y, void *user);
+  void *user;
+} grad_blackbox_t;
+
 struct grad_forward_t {
   size_t id;
   grad_real_t value;
   grad_real_t derivative[GRAD_FORWARD_TAPE_SIZE];
+  // Position in the forward recording, 0 if created while not recording.
+  size_t node;
+  // Input ids [active_begin, active_end) this value may depend on; derivative
+  // is zero outside it and ops skip tangent work there. Both 0, as in a
+  // zero-initialised value, means every input id, like before the range
+  // existed. An empty range at GRAD_FORWARD_TAPE_SIZE marks a passive value.
+  size_t active_begin;
+  size_t active_end;
 };
 
 void grad_forward_start_scope();
 
 grad_forward_t grad_forward_init(grad_real_t value);
+// Passive value: depends on no input and takes no id.
+grad_forward_t grad_forward_constant(grad_real_t value);
 
 grad_forward_t grad_forward_add(const grad_forward_t *left,
                                 const grad_forward_t *right);
@@ -170,9 +391,93 @@ grad_forward_t grad_forward_tan(const grad_forward_t *grad);
 
 grad_forward_t grad_forward_sqrt(const grad_forward_t *grad);
 grad_forward_t grad_forward_pow(const grad_forward_t *grad, grad_real_t e);
+// Writes box->outputs values whose derivatives chain the numerical local
+// Jacobian of box with the derivatives of inputs.
+void grad_forward_blackbox(const grad_blackbox_t *box,
+                           const grad_forward_t *inputs,
+                           grad_forward_t *outputs);
+
+// Between start and stop every forward op also appends its local partials
+// to a recording, so tangents along new seed directions can be replayed
+// without re-evaluating the primal. Values created before the recording
+// started are treated as constants; values from an earlier recording must
+// not be mixed in.
+void grad_forward_record_start(void);
+void grad_forward_record_stop(void);
+// seeds[i * directions + k] is the tangent of the input with id i along
+// direction k; tangents[j * directions + k] receives that of outputs[j].
+// Directions are pushed grad_tune_get()->forward_lanes at a time.
+void grad_forward_replay(const grad_forward_t *const *outputs,
+                         size_t n_outputs, const grad_real_t *seeds,
+                         size_t directions, grad_real_t *tangents);
+
+// GRAD_FORWARD_BATCH_WIDTH independent scalar problems side by side, one per
+// lane, each differentiated with respect to its own single input. The batch
+// ops apply the forward rules lane-wise over contiguous arrays.
+typedef struct grad_forward_batch_t {
+  grad_real_t value[GRAD_FORWARD_BATCH_WIDTH];
+  grad_real_t derivative[GRAD_FORWARD_BATCH_WIDTH];
+} grad_forward_batch_t;
+
+grad_forward_batch_t grad_forward_batch_init(const grad_real_t *value);
+grad_forward_batch_t grad_forward_batch_constant(grad_real_t value);
+grad_forward_batch_t grad_forward_batch_add(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right);
+grad_forward_batch_t grad_forward_batch_add_c(const grad_forward_batch_t *grad,
+                                              grad_real_t constant);
+grad_forward_batch_t grad_forward_batch_mul(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right);
+grad_forward_batch_t grad_forward_batch_mul_c(const grad_forward_batch_t *grad,
+                                              grad_real_t constant);
+grad_forward_batch_t grad_forward_batch_inv(const grad_forward_batch_t *grad);
+grad_forward_batch_t grad_forward_batch_div(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right);
+grad_forward_batch_t grad_forward_batch_neg(const grad_forward_batch_t *grad);
+grad_forward_batch_t grad_forward_batch_sub(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right);
+grad_forward_batch_t grad_forward_batch_exp(const grad_forward_batch_t *grad);
+grad_forward_batch_t grad_forward_batch_log(const grad_forward_batch_t *grad);
+grad_forward_batch_t grad_forward_batch_sin(const grad_forward_batch_t *grad);
+grad_forward_batch_t grad_forward_batch_cos(const grad_forward_batch_t *grad);
+grad_forward_batch_t grad_forward_batch_sqrt(const grad_forward_batch_t *grad);
+grad_forward_batch_t grad_forward_batch_pow(const grad_forward_batch_t *grad,
+                                            grad_real_t e);
+
+#define GRAD_NEWTON_IDLE ((size_t)-1)
+
+// Residuals of the problems held by each lane of x. problem[l] is the index
+// of lane l's problem, or GRAD_NEWTON_IDLE for a lane whose result is
+// ignored.
+typedef void (*grad_newton_batch_fn_t)(const grad_forward_batch_t *x,
+                                       const size_t *problem,
+                                       grad_forward_batch_t *f, void *user);
+
+typedef struct grad_newton_batch_t {
+  size_t converged;
+  // Batched evaluations, and Newton steps taken by occupied lanes;
+  // lane_steps / (sweeps * GRAD_FORWARD_BATCH_WIDTH) is the utilisation.
+  size_t sweeps;
+  size_t lane_steps;
+} grad_newton_batch_t;
+
+// Newton's method on n scalar problems, starting from and overwriting x.
+// A lane whose step falls below tol, turns non-finite or reaches max_iter is
+// retired and immediately refilled with the next queued problem, so lanes
+// stay busy until the queue drains. iterations (may be NULL) receives the
+// steps each problem took, max_iter for those that did not converge.
+grad_newton_batch_t grad_newton_batch(grad_newton_batch_fn_t fn, void *user,
+                                      size_t n, grad_real_t *x,
+                                      grad_real_t tol, size_t max_iter,
+                                      size_t *iterations);
 
 void grad_reverse_start_scope();
 grad_reverse_t *grad_reverse_init(grad_real_t value);
+// Records n leaves as one contiguous block holding values[0..n) and returns
+// the first. Every grad_reverse_backward in this scope then stores the
+// leaves' adjoints into gradients (may be NULL), and grad_reverse_replay
+// re-reads values, so inputs can be updated in place between replays.
+grad_reverse_t *grad_reverse_bind(const grad_real_t *values,
+                                  grad_real_t *gradients, size_t n);
 
 grad_reverse_t *grad_reverse_add(grad_reverse_t *left, grad_reverse_t *right);
 grad_reverse_t *grad_reverse_sub(grad_reverse_t *left, grad_reverse_t *right);
@@ -180,302 +485,4760 @@ grad_reverse_t *grad_reverse_sub(grad_reverse_t *left, grad_reverse_t *right);
 grad_reverse_t *grad_reverse_mul(grad_reverse_t *left, grad_reverse_t *right);
 grad_reverse_t *grad_reverse_div(grad_reverse_t *left, grad_reverse_t *right);
 
+grad_reverse_t *grad_reverse_neg(grad_reverse_t *grad);
+grad_reverse_t *grad_reverse_inv(grad_reverse_t *grad);
+
+grad_reverse_t *grad_reverse_exp(grad_reverse_t *grad);
+grad_reverse_t *grad_reverse_log(grad_reverse_t *grad);
+
+grad_reverse_t *grad_reverse_sin(grad_reverse_t *grad);
+grad_reverse_t *grad_reverse_cos(grad_reverse_t *grad);
+
+// Records box applied to inputs as box->outputs GRAD_OP_BLACKBOX nodes,
+// stored in outputs. Each keeps its row of the local Jacobian, taken
+// numerically with the perturbed evaluations spread over grad_parallel_for,
+// so the rest of the graph stays exact. Replays call box again, so its user
+// data must outlive the scope. Second-order sweeps treat the Jacobian as
+// constant.
+void grad_reverse_blackbox(const grad_blackbox_t *box,
+                           grad_reverse_t *const *inputs,
+                           grad_reverse_t **outputs);
+
 void grad_reverse_backward(grad_reverse_t *grad);
 
+// Backward that only pays for what output reaches through bound blocks:
+// it never zeroes or sweeps grad_reverse_bind leaves and reports the leaves
+// that received adjoint contributions as (tape index, adjoint) pairs, up to
+// capacity of them. Returns how many there were. Bound leaves are reset for
+// the next call instead of keeping their adjoint in derivative, and bound
+// gradient arrays are not written.
+size_t grad_reverse_backward_sparse(grad_reverse_t *output, size_t *index,
+                                    grad_real_t *value, size_t capacity);
+
+// Backward sweep recorded as new nodes on the tape, so each gradient is
+// itself a node that can be differentiated again. gradients[i] receives
+// d output / d inputs[i]; inputs that output does not depend on get a shared
+// zero leaf. Adjoints that are structurally zero are never recorded and
+// multiplications by the unit seed are folded away.
+void grad_reverse_backward_graph(grad_reverse_t *output,
+                                 grad_reverse_t *const *inputs, size_t n,
+                                 grad_reverse_t **gradients);
+
+typedef struct grad_reverse_reorder_t {
+  // Mean distance, in nodes, between a node and each of its operands.
+  double distance_before;
+  double distance_after;
+} grad_reverse_reorder_t;
+
+// Renumbers the current tape into a topological order that keeps each
+// output's subcomputation contiguous (depth-first from the outputs), so the
+// backward sweep touches nearby operands. Node pointers held by the caller
+// are invalidated: if remap is not NULL, remap[old index] is the new index.
+grad_reverse_reorder_t grad_reverse_reorder(grad_reverse_t *const *outputs,
+                                            size_t n_outputs, size_t *remap);
+
+// Rematerialisation plan for the current tape. Backward only reads the
+// values of MUL operands and of the operands of INV, SIN, COS, EXP and LOG.
+// The plan stores those values, except ones cheap enough to recompute from
+// stored ancestors during the sweep, until the store fits the budget.
+typedef struct grad_reverse_remat_t {
+  size_t nodes;
+  size_t stored;
+  size_t recomputed;
+  size_t bytes_stored;
+  // Store size vs. storing every value; the tape itself is not freed.
+  size_t bytes_saved;
+  // Estimated extra op cost per backward, in units of one ADD.
+  size_t recompute_cost;
+  // Per node: index into the store, or GRAD_REMAT_RECOMPUTE / GRAD_REMAT_DEAD.
+  size_t *slot;
+} grad_reverse_remat_t;
+
+#define GRAD_REMAT_RECOMPUTE ((size_t)-2)
+#define GRAD_REMAT_DEAD ((size_t)-1)
+
+grad_reverse_remat_t grad_reverse_remat_plan(size_t budget_bytes);
+// Packs the values the plan stores into store (plan.stored values).
+void grad_reverse_remat_save(const grad_reverse_remat_t *plan,
+                             grad_real_t *store);
+// Backward from output reading values only from store, never from the
+// tape, so the tape's values may have been overwritten since the save.
+void grad_reverse_remat_backward(const grad_reverse_remat_t *plan,
+                                 const grad_real_t *store,
+                                 grad_reverse_t *output);
+void grad_reverse_remat_free(grad_reverse_remat_t *plan);
+
+// Re-evaluates every recorded op in tape order from the current leaf values,
+// e.g. after assigning new inputs to the leaves of a captured tape.
+void grad_reverse_replay(void);
+
+// The tape's ops grouped into dependency levels. Ops of one level only read
+// leaves or ops of earlier levels, so each level can be evaluated in parallel.
+typedef struct grad_reverse_schedule_t {
+  size_t nodes;
+  size_t levels;
+  // Ops of level l are order[offset[l]] .. order[offset[l + 1] - 1].
+  size_t *order;
+  size_t *offset;
+  size_t widest;
+} grad_reverse_schedule_t;
+
+grad_reverse_schedule_t grad_reverse_schedule(void);
+// Like grad_reverse_replay, one level at a time. Levels with more than grain
+// ops are split across the GRAD_THREADS pool; 0 uses the tuned grain.
+void grad_reverse_replay_schedule(const grad_reverse_schedule_t *schedule,
+                                  size_t grain);
+void grad_reverse_schedule_free(grad_reverse_schedule_t *schedule);
+
+typedef void grad_parallel_fn_t(size_t begin, size_t end, void *user);
+// Calls fn on chunks of at least grain indices covering [0, n) and returns
+// once all are done. Runs inline unless the GRAD_THREADS pool is started.
+void grad_parallel_for(size_t n, size_t grain, grad_parallel_fn_t *fn,
+                       void *user);
+
+#ifdef GRAD_THREADS
+// Starts threads - 1 workers; the calling thread is the last. 0 uses every
+// online CPU.
+void grad_threads_start(size_t threads);
+void grad_threads_stop(void);
+size_t grad_threads_count(void);
+#endif // GRAD_THREADS
+
+// Runtime choices for the batched kernels. Without GRAD_TUNE these are the
+// compile-time defaults; with it they are measured on first use.
+typedef struct grad_tune_t {
+  // Directions per pass of grad_forward_replay.
+  size_t forward_lanes;
+  // Directions per sweep of grad_reverse_hutchinson and
+  // grad_reverse_sparse_hessian.
+  size_t hvp_lanes;
+  // Grain used by grad_reverse_replay_schedule when passed 0.
+  size_t parallel_grain;
+  // Pool size used by grad_threads_start(0). Measured under GRAD_THREADS;
+  // otherwise the online CPU count.
+  size_t threads;
+  // Measured seconds per replayed op, 0 if not measured.
+  double op_seconds;
+  // 1 if read back from GRAD_TUNE_FILE.
+  int loaded;
+} grad_tune_t;
+
+const grad_tune_t *grad_tune_get(void);
+#ifdef GRAD_TUNE
+// Re-runs the micro-benchmarks and rewrites GRAD_TUNE_FILE.
+const grad_tune_t *grad_tune_run(void);
+#endif // GRAD_TUNE
+
+// Hessian-vector products of output w.r.t. inputs along `lanes` directions
+// at once. v and hv hold n x lanes values, lanes contiguous per input. Also
+// leaves the gradient in each node's derivative, like grad_reverse_backward.
+void grad_reverse_hvp(grad_reverse_t *output, grad_reverse_t *const *inputs,
+                      size_t n, const grad_real_t *v, grad_real_t *hv,
+                      size_t lanes);
+
+typedef struct grad_hutchinson_t {
+  grad_real_t trace;
+  // Variance of the trace estimate (sample variance / probes).
+  grad_real_t trace_variance;
+  size_t probes;
+} grad_hutchinson_t;
+
+// Stochastic estimates of tr(H) and diag(H) from Rademacher probes, run
+// grad_tune_get()->hvp_lanes probes per sweep. diag, diag_variance and trace
+// may be NULL.
+void grad_reverse_hutchinson(grad_reverse_t *output,
+                             grad_reverse_t *const *inputs, size_t n,
+                             size_t probes, unsigned long long seed,
+                             grad_real_t *diag, grad_real_t *diag_variance,
+                             grad_hutchinson_t *trace);
+
+// Symmetric Hessian in CSR over n inputs. Row i holds columns
+// col[row[i]] .. col[row[i + 1] - 1], sorted, both triangles and the
+// diagonal. colour assigns each input to one of `colours` seed directions.
+typedef struct grad_sparse_hessian_t {
+  size_t n;
+  size_t nnz;
+  size_t *row;
+  size_t *col;
+  grad_real_t *value;
+  size_t colours;
+  size_t *colour;
+} grad_sparse_hessian_t;
+
+// Star-coloured pattern from a user CSR pattern. Either triangle is enough;
+// the transpose and the diagonal are added.
+grad_sparse_hessian_t grad_sparse_hessian_pattern(size_t n, const size_t *row,
+                                                  const size_t *col);
+// Star-coloured pattern found by propagating nonlinear interactions of
+// inputs over the tape from output.
+grad_sparse_hessian_t grad_reverse_hessian_pattern(
+    grad_reverse_t *output, grad_reverse_t *const *inputs, size_t n);
+// Fills hessian->value with one Hessian-vector product per colour, run
+// grad_tune_get()->hvp_lanes colours per sweep.
+void grad_reverse_sparse_hessian(grad_reverse_t *output,
+                                 grad_reverse_t *const *inputs,
+                                 grad_sparse_hessian_t *hessian);
+void grad_sparse_hessian_free(grad_sparse_hessian_t *hessian);
+
+// Objective behind a grad_cache_t: returns f(x) and writes its gradient.
+typedef grad_real_t (*grad_cache_fn_t)(const grad_real_t *x,
+                                       grad_real_t *gradient, void *user);
+
+// LRU cache of (x, f(x), gradient) keyed on an FNV-1a hash of the bytes of
+// x, checked for an exact match on hit.
+typedef struct grad_cache_t {
+  grad_cache_fn_t fn;
+  void *user;
+  size_t n;
+  size_t capacity;
+  size_t hits;
+  size_t misses;
+
+  size_t count;
+  size_t buckets;
+  // Entry e holds x[e * n ..], gradient[e * n ..] and value[e].
+  grad_real_t *x;
+  grad_real_t *gradient;
+  grad_real_t *value;
+  unsigned long long *hash;
+  // Hash chains (bucket heads, then chain) and the LRU list, most recent
+  // first, as entry indices; GRAD_CACHE_NONE ends each.
+  size_t *bucket;
+  size_t *chain;
+  size_t *newer;
+  size_t *older;
+  size_t newest;
+  size_t oldest;
+} grad_cache_t;
+
+#define GRAD_CACHE_NONE ((size_t)-1)
+
+grad_cache_t grad_cache_create(size_t n, size_t capacity, grad_cache_fn_t fn,
+                               void *user);
+// Returns f(x) and writes the gradient (may be NULL), calling fn on a miss.
+grad_real_t grad_cache_eval(grad_cache_t *cache, const grad_real_t *x,
+                            grad_real_t *gradient);
+double grad_cache_hit_rate(const grad_cache_t *cache);
+void grad_cache_free(grad_cache_t *cache);
+
+typedef struct grad_monte_carlo_t {
+  size_t paths;
+  grad_real_t mean;
+  // Standard error of mean.
+  grad_real_t error;
+} grad_monte_carlo_t;
+
+// Pathwise estimate of E[payoff] and its gradient with respect to params,
+// where normals are leaves standing for independent standard normal draws.
+// The graph is recorded once in the current scope; each path overwrites the
+// draws, replays and sweeps backward on a private copy of the tape, blocks
+// of GRAD_MONTE_CARLO_BLOCK paths spread over grad_parallel_for. Path p
+// draws from its own splitmix64 stream derived from seed and p, and block
+// statistics are merged in order, so results do not depend on the thread
+// count. gradient and gradient_error receive n_params means and standard
+// errors. Black-box nodes are not supported.
+grad_monte_carlo_t grad_monte_carlo(grad_reverse_t *payoff,
+                                    grad_reverse_t *const *normals,
+                                    size_t n_normals,
+                                    grad_reverse_t *const *params,
+                                    size_t n_params, size_t paths,
+                                    uint64_t seed, grad_real_t *gradient,
+                                    grad_real_t *gradient_error);
+
+#ifdef GRAD_STATS
+typedef struct grad_stats_t {
+  // Current reverse scope, counted from the tape when queried.
+  size_t nodes[GRAD_OP_COUNT];
+  size_t record_bytes_written;
+  size_t record_bytes_read;
+
+  // High-water marks since the last grad_stats_reset.
+  size_t reverse_peak_id;
+  size_t forward_peak_id;
+
+  // Backward sweeps since the last grad_stats_reset.
+  size_t backward_sweeps;
+  size_t backward_nodes[GRAD_OP_COUNT];
+  // Black-box nodes have one operand per input of their box.
+  size_t backward_blackbox_operands;
+  size_t backward_bytes_read;
+  size_t backward_bytes_written;
+  // Every GRAD_STATS_SAMPLE_PERIOD-th node is timed; the estimate scales the
+  // mean sampled time per op by the number of nodes of that op swept.
+  size_t backward_samples[GRAD_OP_COUNT];
+  double backward_sampled_seconds[GRAD_OP_COUNT];
+  double backward_estimated_seconds[GRAD_OP_COUNT];
+} grad_stats_t;
+
+grad_stats_t grad_stats_get(void);
+void grad_stats_reset(void);
+#endif // GRAD_STATS
+
+#ifdef GRAD_TRACE
+#include <stdio.h>
+
+// name must outlive the trace (string literals are fine).
+void grad_trace_begin(const char *name);
+void grad_trace_end(const char *name);
+void grad_trace_instant(const char *name);
+void grad_trace_dump(FILE *file);
+#endif // GRAD_TRACE
+
+#ifdef GRAD_SOURCE_PROFILE
+#include <stdio.h>
+
+// Flat profile entry for one source line that recorded reverse-mode nodes.
+typedef struct grad_source_profile_t {
+  const char *file;
+  int line;
+  size_t nodes;
+  size_t backward_nodes;
+  // Sampled backward time scaled by GRAD_STATS_SAMPLE_PERIOD.
+  double backward_seconds;
+  // Sum of |adjoint| over this line's nodes across backward sweeps.
+  double adjoint_magnitude;
+} grad_source_profile_t;
+
+void grad_source_mark(const char *file, int line);
+// Copies up to capacity entries, hottest first, and returns how many.
+size_t grad_source_profile(grad_source_profile_t *entries, size_t capacity);
+void grad_source_profile_dump(FILE *file);
+void grad_source_profile_reset(void);
+#endif // GRAD_SOURCE_PROFILE
+
+#ifdef GRAD_PERF
+typedef enum grad_perf_counter_t {
+  GRAD_PERF_CYCLES,
+  GRAD_PERF_INSTRUCTIONS,
+  GRAD_PERF_L1D_MISSES,
+  GRAD_PERF_LLC_MISSES,
+  GRAD_PERF_BRANCH_MISSES,
+  GRAD_PERF_DTLB_MISSES,
+  GRAD_PERF_COUNT,
+} grad_perf_counter_t;
+
+// Hardware counters accumulated over the record phase (scope start until
+// backward) and over grad_reverse_backward, with the nodes each covered.
+typedef struct grad_perf_t {
+  // Bit i is set if counter i could be opened on this machine.
+  unsigned available;
+  unsigned long long record[GRAD_PERF_COUNT];
+  unsigned long long backward[GRAD_PERF_COUNT];
+  size_t record_nodes;
+  size_t backward_nodes;
+} grad_perf_t;
+
+// Returns the mask of counters opened; 0 if perf_event_open is unavailable.
+unsigned grad_perf_open(void);
+void grad_perf_close(void);
+grad_perf_t grad_perf_get(void);
+void grad_perf_reset(void);
+#endif // GRAD_PERF
+
+#ifdef GRAD_METRICS_SHM
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define GRAD_METRICS_MAGIC 0x677261646d657472ull
+#define GRAD_METRICS_BUCKETS 48
+
+// Lives in a POSIX shared-memory segment and is updated with relaxed
+// atomics, so other processes can read it while the service runs.
+typedef struct grad_metrics_t {
+  uint64_t magic;
+  uint64_t size;
+  int64_t pid;
+  // CLOCK_MONOTONIC nanoseconds at grad_metrics_open.
+  uint64_t start_ns;
+  _Atomic uint64_t tapes;
+  _Atomic uint64_t backwards;
+  _Atomic uint64_t backward_nodes;
+  _Atomic uint64_t backward_ns;
+  // Bucket b counts backward passes taking [2^b, 2^(b+1)) nanoseconds.
+  _Atomic uint64_t backward_latency[GRAD_METRICS_BUCKETS];
+  _Atomic uint64_t peak_tape;
+  _Atomic uint64_t pool_threads;
+  _Atomic uint64_t pool_tasks;
+  // Time spent inside grad_parallel_for tasks, summed over threads.
+  _Atomic uint64_t pool_busy_ns;
+} grad_metrics_t;
+
+// Creates (or reopens) the segment name, e.g. "/grad_metrics", and starts
+// publishing to it. A segment whose publisher is still running keeps its
+// counters, so concurrent processes add to the same totals; one left behind
+// by an exited process is reset. Returns NULL if shared memory is
+// unavailable.
+grad_metrics_t *grad_metrics_open(const char *name);
+// Unmaps the segment but leaves it in place for readers.
+void grad_metrics_close(void);
+// Removes the segment name; mappings stay valid until closed. Returns 0 on
+// success.
+int grad_metrics_unlink(const char *name);
+#endif // GRAD_METRICS_SHM
+
+#ifdef GRAD_DATASET
+// Read-only mapping of a file of fixed-size binary samples.
+typedef struct grad_dataset_t {
+  const unsigned char *data;
+  size_t bytes;
+  size_t sample_bytes;
+  size_t samples;
+} grad_dataset_t;
+
+// Maps path as consecutive sample_bytes records; a trailing partial record
+// is ignored. Returns 0 on success.
+int grad_dataset_open(grad_dataset_t *dataset, const char *path,
+                      size_t sample_bytes);
+void grad_dataset_close(grad_dataset_t *dataset);
+
+// Records the loss of count consecutive samples in terms of params, the
+// leaves bound to the parameter values, and returns it.
+typedef grad_reverse_t *(*grad_dataset_loss_fn_t)(
+    grad_reverse_t *const *params, const void *samples, size_t count,
+    void *user);
+
+// Walks samples [begin, end) chunk samples at a time. Each chunk gets a
+// fresh reverse scope with params bound through grad_reverse_bind, so the
+// tape only ever holds one chunk's graph, and its gradient is added to
+// gradient. The next GRAD_DATASET_PREFETCH chunks are advised in ahead and
+// finished ones released, so resident file pages stay bounded too. Returns
+// the summed loss.
+grad_real_t grad_dataset_accumulate(const grad_dataset_t *dataset,
+                                    size_t begin, size_t end, size_t chunk,
+                                    grad_dataset_loss_fn_t loss, void *user,
+                                    const grad_real_t *params,
+                                    size_t n_params, grad_real_t *gradient);
+#endif // GRAD_DATASET
+
+// Right-hand side dy/dt = f(t, y, p), recorded with grad_reverse_* ops on
+// fresh leaves for y and p. Called once per stage, so it must only build on
+// the leaves it is given.
+typedef void (*grad_ode_rhs_t)(grad_real_t t, grad_reverse_t *const *y,
+                               grad_reverse_t *const *p, grad_reverse_t **dydt,
+                               void *user);
+
+// Same right-hand side in forward mode, used by grad_ode_sensitivity. Each
+// parameter is a forward-mode input, so dydt[i].derivative[j] is the
+// directional derivative along parameter j, all parameters in one call.
+typedef void (*grad_ode_forward_rhs_t)(grad_real_t t, const grad_forward_t *y,
+                                       const grad_forward_t *p,
+                                       grad_forward_t *dydt, void *user);
+
+typedef struct grad_ode_t {
+  grad_ode_rhs_t rhs;
+  grad_ode_forward_rhs_t forward_rhs;
+  void *user;
+  size_t state_size;
+  size_t param_size;
+  grad_real_t rtol;
+  grad_real_t atol;
+  size_t max_steps;
+
+  // Filled by grad_ode_solve, consumed by grad_ode_adjoint.
+  grad_real_t t0;
+  grad_real_t t1;
+  size_t steps;
+  grad_real_t checkpoint[GRAD_ODE_CHECKPOINTS + 1][GRAD_ODE_MAX_STATE];
+} grad_ode_t;
+
+void grad_ode_solve(grad_ode_t *ode, grad_real_t t0, grad_real_t t1,
+                    grad_real_t *y, const grad_real_t *p);
+void grad_ode_adjoint(grad_ode_t *ode, const grad_real_t *p,
+                      const grad_real_t *y1_bar, grad_real_t *y0_bar,
+                      grad_real_t *p_bar);
+// Integrates y and the sensitivities S = dy/dp together from t0 to t1.
+// sensitivity is in/out, state_size rows of param_size entries (row i holds
+// dy_i/dp): it must hold S(t0) on entry, usually zeros, and holds S(t1) on
+// return.
+void grad_ode_sensitivity(grad_ode_t *ode, grad_real_t t0, grad_real_t t1,
+                          grad_real_t *y, const grad_real_t *p,
+                          grad_real_t *sensitivity);
+
+// Residual F(x, p) of a root solve, or the map G(x, p) of a fixed point
+// x = G(x, p), recorded with grad_reverse_* ops on fresh leaves.
+typedef void (*grad_implicit_fn_t)(grad_reverse_t *const *x,
+                                   grad_reverse_t *const *p,
+                                   grad_reverse_t **out, void *user);
+
+typedef enum grad_implicit_kind_t {
+  GRAD_IMPLICIT_ROOT,
+  GRAD_IMPLICIT_FIXED_POINT,
+} grad_implicit_kind_t;
+
+typedef struct grad_implicit_t {
+  grad_implicit_kind_t kind;
+  grad_implicit_fn_t fn;
+  void *user;
+  size_t state_size;
+  size_t param_size;
+  grad_real_t tol;
+  size_t max_iter;
+
+  // Iterations taken by the last grad_implicit_solve / grad_implicit_vjp.
+  size_t iterations;
+} grad_implicit_t;
+
+void grad_implicit_solve(grad_implicit_t *imp, grad_real_t *x,
+                         const grad_real_t *p);
+void grad_implicit_vjp(grad_implicit_t *imp, const grad_real_t *x,
+                       const grad_real_t *p, const grad_real_t *x_bar,
+                       grad_real_t *p_bar);
+
 #ifdef GRAD_IMPLEMENTATION
 
 #include <assert.h>
+#include <float.h>
 #include <math.h>
+#include <stdint.h>
 #include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
 
-size_t grad_forward_current_id = 0;
+// splitmix64
+static uint64_t grad__random_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
 
-void grad_forward_start_scope() { grad_forward_current_id = 0; }
+#if defined(GRAD_STATS) || defined(GRAD_SOURCE_PROFILE)
+#define GRAD__SAMPLING
+#endif
 
-grad_forward_t grad_forward_init(grad_real_t value) {
-  assert(grad_forward_current_id < GRAD_FORWARD_TAPE_SIZE);
-  grad_forward_t result = {0};
-  result.value = value;
-  memset(result.derivative, 0, sizeof(grad_real_t) * GRAD_FORWARD_TAPE_SIZE);
-  result.id = grad_forward_current_id;
-  result.derivative[grad_forward_current_id] = (grad_real_t)1.0;
-  grad_forward_current_id += 1;
-  return result;
+#if defined(GRAD__SAMPLING) || defined(GRAD_TRACE) || defined(GRAD_TUNE) ||   \
+    defined(GRAD_METRICS_SHM)
+#include <time.h>
+#ifndef CLOCK_MONOTONIC
+#error "grad.h: clock_gettime needs _DEFAULT_SOURCE before any #include"
+#endif
+
+static uint64_t grad__now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
+#endif
 
-grad_forward_t grad_forward_add(const grad_forward_t *left,
-                                const grad_forward_t *right) {
-  grad_forward_t result = {0};
-  result.value = left->value + right->value;
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] = left->derivative[i] + right->derivative[i];
-  }
-  return result;
+#ifdef GRAD__SAMPLING
+// Backward timing samples one in GRAD_STATS_SAMPLE_PERIOD nodes.
+size_t grad__sample_countdown = GRAD_STATS_SAMPLE_PERIOD;
+double grad__sample_overhead = -1;
+
+static double grad__now_seconds(void) {
+  return (double)grad__now_ns() * 1e-9;
 }
 
-grad_forward_t grad_forward_add_c(const grad_forward_t *grad,
-                                  grad_real_t constant) {
-  grad_forward_t result = {0};
-  result.value = grad->value + constant;
-  memcpy(result.derivative, grad->derivative,
-         sizeof(grad_real_t) * GRAD_FORWARD_TAPE_SIZE);
-  return result;
+// Cost of an empty timed region, subtracted from every sample.
+static double grad__sample_timer_overhead(void) {
+  if (grad__sample_overhead < 0) {
+    double best = 1;
+    for (int i = 0; i < 64; ++i) {
+      double start = grad__now_seconds();
+      double elapsed = grad__now_seconds() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    grad__sample_overhead = best;
+  }
+  return grad__sample_overhead;
 }
+#endif // GRAD__SAMPLING
 
-grad_forward_t grad_forward_mul(const grad_forward_t *left,
-                                const grad_forward_t *right) {
-  grad_forward_t result = {0};
-  result.value = left->value * right->value;
+#ifdef GRAD_STATS
+grad_stats_t grad__stats;
 
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] =
-        left->derivative[i] * right->value + left->value * right->derivative[i];
+#define GRAD__STATS(statement) statement
+#else
+#define GRAD__STATS(statement)
+#endif // GRAD_STATS
+
+#ifdef GRAD_TRACE
+#include <stdatomic.h>
+
+// sequence is the event's index + 1 once written and 0 while the owner
+// rewrites the slot, so a reader can tell a torn copy from a whole one.
+typedef struct grad__trace_event_t {
+  _Atomic size_t sequence;
+  _Atomic(const char *) name;
+  _Atomic uint64_t timestamp;
+  _Atomic char phase;
+} grad__trace_event_t;
+
+// One ring per thread, written only by its owner. head counts every event
+// ever pushed; once it passes GRAD_TRACE_RING_SIZE the oldest are overwritten.
+typedef struct grad__trace_ring_t {
+  struct grad__trace_ring_t *next;
+  size_t thread;
+  _Atomic size_t head;
+  grad__trace_event_t events[GRAD_TRACE_RING_SIZE];
+} grad__trace_ring_t;
+
+_Atomic(grad__trace_ring_t *) grad__trace_rings = NULL;
+_Atomic size_t grad__trace_threads = 0;
+_Thread_local grad__trace_ring_t *grad__trace_ring = NULL;
+_Thread_local int grad__trace_recording = 0;
+
+static void grad__trace_push(const char *name, char phase) {
+  grad__trace_ring_t *ring = grad__trace_ring;
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(grad__trace_ring_t));
+    if (ring == NULL) {
+      return;
+    }
+    ring->thread = atomic_fetch_add_explicit(&grad__trace_threads, 1,
+                                             memory_order_relaxed);
+    ring->next = atomic_load_explicit(&grad__trace_rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &grad__trace_rings, &ring->next, ring, memory_order_release,
+        memory_order_relaxed)) {
+    }
+    grad__trace_ring = ring;
   }
-  return result;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  grad__trace_event_t *event = &ring->events[head % GRAD_TRACE_RING_SIZE];
+  atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&event->name, name, memory_order_relaxed);
+  atomic_store_explicit(&event->timestamp, grad__now_ns(),
+                        memory_order_relaxed);
+  atomic_store_explicit(&event->phase, phase, memory_order_relaxed);
+  atomic_store_explicit(&event->sequence, head + 1, memory_order_release);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
-grad_forward_t grad_forward_mul_c(const grad_forward_t *grad,
-                                  const grad_real_t constant) {
-  grad_forward_t result = {0};
-  result.value = grad->value * constant;
+void grad_trace_begin(const char *name) { grad__trace_push(name, 'B'); }
 
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] = constant * grad->derivative[i];
+void grad_trace_end(const char *name) { grad__trace_push(name, 'E'); }
+
+void grad_trace_instant(const char *name) { grad__trace_push(name, 'i'); }
+
+static void grad__trace_write_string(FILE *file, const char *text) {
+  fputc('"', file);
+  for (const unsigned char *c = (const unsigned char *)text; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(file, "\\%c", *c);
+    } else if (*c < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
   }
-  return result;
+  fputc('"', file);
 }
 
-grad_forward_t grad_forward_inv(const grad_forward_t *grad) {
-  grad_forward_t result = {0};
-  result.value = (grad_real_t)1.0f / grad->value;
+// Dumps every ring as Chrome trace JSON, loadable in Perfetto or
+// chrome://tracing. Safe to call while other threads keep tracing: events
+// they overwrite during the dump are dropped rather than torn, as are ends
+// whose begin has already left the ring.
+void grad_trace_dump(FILE *file) {
+  int first = 1;
+  fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  for (grad__trace_ring_t *ring =
+           atomic_load_explicit(&grad__trace_rings, memory_order_acquire);
+       ring != NULL; ring = ring->next) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t begin =
+        head > GRAD_TRACE_RING_SIZE ? head - GRAD_TRACE_RING_SIZE : 0;
+    size_t depth = 0;
+    for (size_t i = begin; i < head; ++i) {
+      grad__trace_event_t *slot = &ring->events[i % GRAD_TRACE_RING_SIZE];
+      size_t sequence =
+          atomic_load_explicit(&slot->sequence, memory_order_acquire);
+      const char *name =
+          atomic_load_explicit(&slot->name, memory_order_relaxed);
+      uint64_t timestamp =
+          atomic_load_explicit(&slot->timestamp, memory_order_relaxed);
+      char phase = atomic_load_explicit(&slot->phase, memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+      if (sequence != i + 1 ||
+          atomic_load_explicit(&slot->sequence, memory_order_relaxed) !=
+              sequence) {
+        continue;
+      }
+      if (phase == 'E' && depth == 0) {
+        continue;
+      }
+      depth += phase == 'B' ? 1 : phase == 'E' ? (size_t)-1 : 0;
 
-  grad_real_t inv_sq = (grad_real_t)1.0 / (grad->value * grad->value);
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] = -grad->derivative[i] * inv_sq;
+      fprintf(file, "%s\n{\"name\": ", first ? "" : ",");
+      grad__trace_write_string(file, name);
+      fprintf(file,
+              ", \"cat\": \"grad\", \"ph\": \"%c\", \"ts\": %.3f, "
+              "\"pid\": 1, \"tid\": %zu%s}",
+              phase, (double)timestamp / 1000.0, ring->thread,
+              phase == 'i' ? ", \"s\": \"t\"" : "");
+      first = 0;
+    }
   }
-  return result;
+  fprintf(file, "\n]}\n");
 }
 
-grad_forward_t grad_forward_div(const grad_forward_t *left,
-                                const grad_forward_t *right) {
-  grad_forward_t right_inv = grad_forward_inv(right);
-  return grad_forward_mul(left, &right_inv);
+#define GRAD__TRACE(statement) statement
+#else
+#define GRAD__TRACE(statement)
+#endif // GRAD_TRACE
+
+#ifdef GRAD_METRICS_SHM
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+grad_metrics_t *grad__metrics = NULL;
+uint64_t grad__metrics_backward_start = 0;
+
+grad_metrics_t *grad_metrics_open(const char *name) {
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      ((size_t)st.st_size < sizeof(grad_metrics_t) &&
+       ftruncate(fd, sizeof(grad_metrics_t)) != 0)) {
+    close(fd);
+    return NULL;
+  }
+  void *memory = mmap(NULL, sizeof(grad_metrics_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+  grad_metrics_t *metrics = memory;
+  int live = metrics->magic == GRAD_METRICS_MAGIC &&
+             metrics->size == sizeof(grad_metrics_t) &&
+             (kill((pid_t)metrics->pid, 0) == 0 || errno == EPERM);
+  if (!live) {
+    metrics->magic = 0;
+    atomic_thread_fence(memory_order_release);
+    memset(metrics, 0, sizeof(grad_metrics_t));
+    metrics->size = sizeof(grad_metrics_t);
+    metrics->pid = (int64_t)getpid();
+    metrics->start_ns = grad__now_ns();
+    atomic_thread_fence(memory_order_release);
+    metrics->magic = GRAD_METRICS_MAGIC;
+  }
+  grad__metrics = metrics;
+  return metrics;
 }
 
-grad_forward_t grad_forward_neg(const grad_forward_t *grad) {
-  return grad_forward_mul_c(grad, -1);
+void grad_metrics_close(void) {
+  if (grad__metrics != NULL) {
+    munmap(grad__metrics, sizeof(grad_metrics_t));
+    grad__metrics = NULL;
+  }
 }
 
-grad_forward_t grad_forward_sub(const grad_forward_t *left,
-                                const grad_forward_t *right) {
-  grad_forward_t right_neg = grad_forward_neg(right);
-  return grad_forward_add(left, &right_neg);
+int grad_metrics_unlink(const char *name) { return shm_unlink(name); }
+
+static void grad__metrics_add(_Atomic uint64_t *counter, uint64_t amount) {
+  atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
 }
 
-grad_forward_t grad_forward_exp(const grad_forward_t *grad) {
-  grad_forward_t result = {0};
-  result.value = GRAD_EXP(grad->value);
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] = result.value * grad->derivative[i];
+static void grad__metrics_peak(uint64_t nodes) {
+  uint64_t peak =
+      atomic_load_explicit(&grad__metrics->peak_tape, memory_order_relaxed);
+  while (nodes > peak && !atomic_compare_exchange_weak_explicit(
+                             &grad__metrics->peak_tape, &peak, nodes,
+                             memory_order_relaxed, memory_order_relaxed)) {
   }
-  return result;
 }
 
-grad_forward_t grad_forward_log(const grad_forward_t *grad) {
-  grad_forward_t result = {0};
-  result.value = GRAD_LOG(grad->value);
-  grad_real_t inv = (grad_real_t)1.0 / grad->value;
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] = inv * grad->derivative[i];
+static void grad__metrics_backward(uint64_t nanoseconds, uint64_t nodes) {
+  size_t bucket = 0;
+  while (bucket + 1 < GRAD_METRICS_BUCKETS && (nanoseconds >> (bucket + 1))) {
+    bucket += 1;
   }
-  return result;
+  grad__metrics_add(&grad__metrics->backwards, 1);
+  grad__metrics_add(&grad__metrics->backward_nodes, nodes);
+  grad__metrics_add(&grad__metrics->backward_ns, nanoseconds);
+  grad__metrics_add(&grad__metrics->backward_latency[bucket], 1);
+  grad__metrics_peak(nodes);
 }
 
-grad_forward_t grad_forward_sin(const grad_forward_t *grad) {
-  grad_forward_t result = {0};
-  result.value = GRAD_SIN(grad->value);
-  grad_real_t val = GRAD_COS(grad->value);
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] = val * grad->derivative[i];
+#define GRAD__METRICS(statement)                                             \
+  do {                                                                       \
+    if (grad__metrics != NULL) {                                             \
+      statement;                                                             \
+    }                                                                        \
+  } while (0)
+#else
+#define GRAD__METRICS(statement)
+#endif // GRAD_METRICS_SHM
+
+#ifdef GRAD_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Workers sleep on wake until generation moves, claim chunks from next and
+// report on done. submit serialises grad_parallel_for callers.
+typedef struct grad__pool_t {
+  pthread_mutex_t submit;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  pthread_t workers[GRAD_THREADS_MAX];
+  size_t threads;
+  size_t generation;
+  size_t busy;
+  int stop;
+  grad_parallel_fn_t *fn;
+  void *user;
+  size_t n;
+  size_t grain;
+  _Atomic size_t next;
+} grad__pool_t;
+
+grad__pool_t grad__pool = {
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .threads = 1,
+};
+_Thread_local int grad__pool_inside = 0;
+
+static void grad__pool_run(void) {
+  for (;;) {
+    size_t begin = atomic_fetch_add_explicit(&grad__pool.next,
+                                             grad__pool.grain,
+                                             memory_order_relaxed);
+    if (begin >= grad__pool.n) {
+      break;
+    }
+    size_t end = grad__pool.n - begin > grad__pool.grain
+                     ? begin + grad__pool.grain
+                     : grad__pool.n;
+    GRAD__TRACE(grad_trace_begin("task"));
+#ifdef GRAD_METRICS_SHM
+    uint64_t task_start = grad__metrics ? grad__now_ns() : 0;
+#endif // GRAD_METRICS_SHM
+    grad__pool.fn(begin, end, grad__pool.user);
+    GRAD__METRICS(grad__metrics_add(&grad__metrics->pool_tasks, 1));
+    GRAD__METRICS(grad__metrics_add(&grad__metrics->pool_busy_ns,
+                                    grad__now_ns() - task_start));
+    GRAD__TRACE(grad_trace_end("task"));
   }
-  return result;
 }
 
-grad_forward_t grad_forward_cos(const grad_forward_t *grad) {
-  grad_forward_t result = {0};
-  result.value = GRAD_COS(grad->value);
-  grad_real_t val = -GRAD_SIN(grad->value);
-  for (size_t i = 0; i < grad_forward_current_id; i++) {
-    result.derivative[i] = val * grad->derivative[i];
+static void *grad__pool_worker(void *arg) {
+  (void)arg;
+  size_t seen = 0;
+  grad__pool_inside = 1;
+  pthread_mutex_lock(&grad__pool.mutex);
+  for (;;) {
+    while (!grad__pool.stop && grad__pool.generation == seen) {
+      pthread_cond_wait(&grad__pool.wake, &grad__pool.mutex);
+    }
+    if (grad__pool.stop) {
+      break;
+    }
+    seen = grad__pool.generation;
+    pthread_mutex_unlock(&grad__pool.mutex);
+    grad__pool_run();
+    pthread_mutex_lock(&grad__pool.mutex);
+    grad__pool.busy -= 1;
+    if (grad__pool.busy == 0) {
+      pthread_cond_signal(&grad__pool.done);
+    }
   }
-  return result;
+  pthread_mutex_unlock(&grad__pool.mutex);
+  return NULL;
 }
 
-grad_forward_t grad_forward_tan(const grad_forward_t *grad) {
-  grad_forward_t s = grad_forward_sin(grad);
-  grad_forward_t c = grad_forward_cos(grad);
-  return grad_forward_div(&s, &c);
+void grad_threads_start(size_t threads) {
+  assert(grad__pool.threads == 1);
+  threads = threads ? threads : grad_tune_get()->threads;
+  threads = threads < GRAD_THREADS_MAX ? threads : GRAD_THREADS_MAX;
+  grad__pool.stop = 0;
+  grad__pool.generation = 0;
+  for (size_t i = 1; i < threads; ++i) {
+    if (pthread_create(&grad__pool.workers[i - 1], NULL, grad__pool_worker,
+                       NULL) != 0) {
+      threads = i;
+      break;
+    }
+  }
+  grad__pool.threads = threads;
+  GRAD__METRICS(atomic_store_explicit(&grad__metrics->pool_threads, threads,
+                                      memory_order_relaxed));
 }
 
-grad_forward_t grad_forward_sqrt(const grad_forward_t *grad) {
-  grad_forward_t result = {0};
-  result.value = GRAD_SQRT(grad->value);
-  grad_real_t inv = (grad_real_t)0.5 / result.value;
-  for (size_t i = 0; i < grad_forward_current_id; ++i) {
-    result.derivative[i] = inv * grad->derivative[i];
+void grad_threads_stop(void) {
+  pthread_mutex_lock(&grad__pool.mutex);
+  grad__pool.stop = 1;
+  pthread_cond_broadcast(&grad__pool.wake);
+  pthread_mutex_unlock(&grad__pool.mutex);
+  for (size_t i = 1; i < grad__pool.threads; ++i) {
+    pthread_join(grad__pool.workers[i - 1], NULL);
   }
-  return result;
+  grad__pool.threads = 1;
+  GRAD__METRICS(atomic_store_explicit(&grad__metrics->pool_threads, 1,
+                                      memory_order_relaxed));
 }
 
-grad_forward_t grad_forward_pow(const grad_forward_t *grad, grad_real_t e) {
-  grad_forward_t result = {0};
-  result.value = GRAD_POW(grad->value, e);
-  grad_real_t val = GRAD_POW(grad->value, e - 1);
-  for (size_t i = 0; i < grad_forward_current_id; ++i) {
-    result.derivative[i] = e * val * grad->derivative[i];
+size_t grad_threads_count(void) { return grad__pool.threads; }
+#endif // GRAD_THREADS
+
+void grad_parallel_for(size_t n, size_t grain, grad_parallel_fn_t *fn,
+                       void *user) {
+  grain = grain ? grain : 1;
+#ifdef GRAD_THREADS
+  if (grad__pool.threads > 1 && n > grain && !grad__pool_inside) {
+    pthread_mutex_lock(&grad__pool.submit);
+    pthread_mutex_lock(&grad__pool.mutex);
+    grad__pool.fn = fn;
+    grad__pool.user = user;
+    grad__pool.n = n;
+    grad__pool.grain = grain;
+    atomic_store_explicit(&grad__pool.next, 0, memory_order_relaxed);
+    grad__pool.busy = grad__pool.threads - 1;
+    grad__pool.generation += 1;
+    pthread_cond_broadcast(&grad__pool.wake);
+    pthread_mutex_unlock(&grad__pool.mutex);
+
+    grad__pool_inside = 1;
+    grad__pool_run();
+    grad__pool_inside = 0;
+
+    pthread_mutex_lock(&grad__pool.mutex);
+    while (grad__pool.busy != 0) {
+      pthread_cond_wait(&grad__pool.done, &grad__pool.mutex);
+    }
+    pthread_mutex_unlock(&grad__pool.mutex);
+    pthread_mutex_unlock(&grad__pool.submit);
+    return;
+  }
+#endif // GRAD_THREADS
+  if (n > 0) {
+    fn(0, n, user);
   }
-  return result;
 }
 
-grad_reverse_t grad_reverse_tape[GRAD_REVERSE_TAPE_SIZE];
-size_t grad_reverse_current_id = 0;
+#ifdef GRAD_SOURCE_PROFILE
+#include <stdio.h>
 
-void grad_reverse_start_scope() { grad_reverse_current_id = 0; }
+// Slot 0 collects nodes recorded by the library itself before any marked
+// call, e.g. leaves created inside grad_ode_adjoint.
+grad_source_profile_t grad__source_locations[GRAD_SOURCE_PROFILE_SIZE] = {
+    {"<unknown>", 0, 0, 0, 0, 0}};
+size_t grad__source_location_count = 1;
+size_t grad__source_current = 0;
+uint32_t grad__reverse_source[GRAD_REVERSE_TAPE_SIZE];
 
-grad_reverse_t *grad_reverse_init(grad_real_t value) {
-  assert(grad_reverse_current_id < GRAD_REVERSE_TAPE_SIZE);
-  grad_reverse_t *result = &grad_reverse_tape[grad_reverse_current_id];
-  grad_reverse_current_id += 1;
+void grad_source_mark(const char *file, int line) {
+  const grad_source_profile_t *current =
+      &grad__source_locations[grad__source_current];
+  if (current->file == file && current->line == line) {
+    return;
+  }
+  for (size_t i = 1; i < grad__source_location_count; ++i) {
+    if (grad__source_locations[i].line == line &&
+        grad__source_locations[i].file == file) {
+      grad__source_current = i;
+      return;
+    }
+  }
+  if (grad__source_location_count == GRAD_SOURCE_PROFILE_SIZE) {
+    grad__source_current = 0;
+    return;
+  }
+  grad_source_profile_t *entry =
+      &grad__source_locations[grad__source_location_count];
+  memset(entry, 0, sizeof(*entry));
+  entry->file = file;
+  entry->line = line;
+  grad__source_current = grad__source_location_count++;
+}
 
-  result->value = value;
-  result->operation = GRAD_OP_NONE;
-  result->derivative = (grad_real_t)0.0;
+static void grad__source_backward(size_t node, grad_real_t adjoint) {
+  grad_source_profile_t *entry =
+      &grad__source_locations[grad__reverse_source[node]];
+  entry->backward_nodes += 1;
+  entry->adjoint_magnitude += fabs(adjoint);
+}
 
-  return result;
+static void grad__source_sample(size_t node, double seconds) {
+  grad__source_locations[grad__reverse_source[node]].backward_seconds +=
+      seconds * GRAD_STATS_SAMPLE_PERIOD;
 }
 
-grad_reverse_t *grad_reverse_add(grad_reverse_t *left, grad_reverse_t *right) {
-  grad_reverse_t *result = grad_reverse_init(left->value + right->value);
-  result->operation = GRAD_OP_ADD;
-  result->left = left;
-  result->right = right;
+static int grad__source_compare(const void *a, const void *b) {
+  const grad_source_profile_t *left = a;
+  const grad_source_profile_t *right = b;
+  if (left->backward_seconds != right->backward_seconds) {
+    return left->backward_seconds < right->backward_seconds ? 1 : -1;
+  }
+  return left->nodes < right->nodes ? 1 : left->nodes > right->nodes ? -1 : 0;
+}
+
+size_t grad_source_profile(grad_source_profile_t *entries, size_t capacity) {
+  size_t count = 0;
+  grad_source_profile_t sorted[GRAD_SOURCE_PROFILE_SIZE];
+  for (size_t i = 0; i < grad__source_location_count; ++i) {
+    const grad_source_profile_t *entry = &grad__source_locations[i];
+    if (entry->nodes || entry->backward_nodes) {
+      sorted[count++] = *entry;
+    }
+  }
+  qsort(sorted, count, sizeof(grad_source_profile_t), grad__source_compare);
+  count = count < capacity ? count : capacity;
+  memcpy(entries, sorted, sizeof(grad_source_profile_t) * count);
+  return count;
+}
+
+void grad_source_profile_dump(FILE *file) {
+  grad_source_profile_t entries[GRAD_SOURCE_PROFILE_SIZE];
+  size_t count = grad_source_profile(entries, GRAD_SOURCE_PROFILE_SIZE);
+  double total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += entries[i].backward_seconds;
+  }
+  fprintf(file, "%7s %12s %12s %12s %12s  %s\n", "time%", "backward_us",
+          "nodes", "swept", "|adjoint|", "location");
+  for (size_t i = 0; i < count; ++i) {
+    const grad_source_profile_t *e = &entries[i];
+    fprintf(file, "%6.2f%% %12.1f %12zu %12zu %12.4g  %s:%d\n",
+            total > 0 ? 100.0 * e->backward_seconds / total : 0.0,
+            e->backward_seconds * 1e6, e->nodes, e->backward_nodes,
+            e->adjoint_magnitude, e->file, e->line);
+  }
+}
+
+void grad_source_profile_reset(void) {
+  for (size_t i = 0; i < grad__source_location_count; ++i) {
+    grad__source_locations[i].nodes = 0;
+    grad__source_locations[i].backward_nodes = 0;
+    grad__source_locations[i].backward_seconds = 0;
+    grad__source_locations[i].adjoint_magnitude = 0;
+  }
+}
+
+#define GRAD__SOURCE(statement) statement
+#else
+#define GRAD__SOURCE(statement)
+#endif // GRAD_SOURCE_PROFILE
+
+#ifdef GRAD_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if !defined(_DEFAULT_SOURCE) && !defined(_GNU_SOURCE)
+#error "grad.h: GRAD_PERF needs _DEFAULT_SOURCE before any #include"
+#endif
+
+typedef enum grad__perf_phase_t {
+  GRAD__PERF_IDLE,
+  GRAD__PERF_RECORD,
+  GRAD__PERF_BACKWARD,
+} grad__perf_phase_t;
+
+grad_perf_t grad__perf;
+int grad__perf_leader = -1;
+int grad__perf_fd[GRAD_PERF_COUNT];
+// Position of each opened counter in a group read.
+size_t grad__perf_slot[GRAD_PERF_COUNT];
+size_t grad__perf_opened = 0;
+unsigned long long grad__perf_last[GRAD_PERF_COUNT];
+grad__perf_phase_t grad__perf_phase = GRAD__PERF_IDLE;
+
+static int grad__perf_event(uint32_t type, uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Current totals, scaled up if the kernel had to multiplex the group.
+static void grad__perf_read(unsigned long long *totals) {
+  uint64_t buffer[3 + GRAD_PERF_COUNT];
+  memset(totals, 0, sizeof(unsigned long long) * GRAD_PERF_COUNT);
+  if (grad__perf_leader < 0 ||
+      read(grad__perf_leader, buffer, sizeof(buffer)) <= 0) {
+    return;
+  }
+  double scale = buffer[2] ? (double)buffer[1] / (double)buffer[2] : 0;
+  for (size_t c = 0; c < GRAD_PERF_COUNT; ++c) {
+    if (grad__perf.available & (1u << c)) {
+      totals[c] =
+          (unsigned long long)((double)buffer[3 + grad__perf_slot[c]] * scale);
+    }
+  }
+}
+
+// Charges the counts since the last switch to the phase that was running.
+static void grad__perf_switch(grad__perf_phase_t next, size_t nodes) {
+  if (grad__perf_leader < 0) {
+    return;
+  }
+  unsigned long long now[GRAD_PERF_COUNT];
+  grad__perf_read(now);
+  unsigned long long *target = grad__perf_phase == GRAD__PERF_RECORD
+                                   ? grad__perf.record
+                               : grad__perf_phase == GRAD__PERF_BACKWARD
+                                   ? grad__perf.backward
+                                   : NULL;
+  for (size_t c = 0; target && c < GRAD_PERF_COUNT; ++c) {
+    target[c] += now[c] - grad__perf_last[c];
+  }
+  if (grad__perf_phase == GRAD__PERF_RECORD) {
+    grad__perf.record_nodes += nodes;
+  } else if (grad__perf_phase == GRAD__PERF_BACKWARD) {
+    grad__perf.backward_nodes += nodes;
+  }
+  memcpy(grad__perf_last, now, sizeof(now));
+  grad__perf_phase = next;
+}
+
+unsigned grad_perf_open(void) {
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } events[GRAD_PERF_COUNT] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE,
+       PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE,
+       PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  };
+
+  grad_perf_close();
+  for (size_t c = 0; c < GRAD_PERF_COUNT; ++c) {
+    int fd = grad__perf_event(events[c].type, events[c].config,
+                              grad__perf_leader);
+    grad__perf_fd[c] = fd;
+    if (fd < 0) {
+      continue;
+    }
+    if (grad__perf_leader < 0) {
+      grad__perf_leader = fd;
+    }
+    grad__perf_slot[c] = grad__perf_opened++;
+    grad__perf.available |= 1u << c;
+  }
+  if (grad__perf_leader >= 0) {
+    ioctl(grad__perf_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(grad__perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    grad__perf_read(grad__perf_last);
+  }
+  return grad__perf.available;
+}
+
+void grad_perf_close(void) {
+  for (size_t c = 0; c < GRAD_PERF_COUNT; ++c) {
+    if (grad__perf.available & (1u << c)) {
+      close(grad__perf_fd[c]);
+    }
+  }
+  memset(&grad__perf, 0, sizeof(grad__perf));
+  grad__perf_leader = -1;
+  grad__perf_opened = 0;
+  grad__perf_phase = GRAD__PERF_IDLE;
+}
+
+grad_perf_t grad_perf_get(void) { return grad__perf; }
+
+void grad_perf_reset(void) {
+  unsigned available = grad__perf.available;
+  memset(&grad__perf, 0, sizeof(grad__perf));
+  grad__perf.available = available;
+  grad__perf_read(grad__perf_last);
+}
+
+#define GRAD__PERF(statement) statement
+#else
+#define GRAD__PERF(statement)
+#endif // GRAD_PERF
+
+size_t grad_forward_current_id = 0;
+
+// Node 0 stands for every value created outside the recording; its tangent
+// row stays zero.
+typedef struct grad__forward_entry_t {
+  size_t result;
+  size_t left;
+  size_t right;
+  grad_real_t left_partial;
+  grad_real_t right_partial;
+} grad__forward_entry_t;
+
+typedef struct grad__forward_input_t {
+  size_t node;
+  size_t id;
+} grad__forward_input_t;
+
+int grad__forward_recording = 0;
+size_t grad__forward_nodes = 0;
+size_t grad__forward_entry_count = 0;
+size_t grad__forward_input_count = 0;
+grad__forward_entry_t grad__forward_entries[GRAD_FORWARD_RECORD_SIZE];
+grad__forward_input_t grad__forward_inputs[GRAD_FORWARD_RECORD_SIZE];
+grad_real_t grad__forward_lanes[GRAD_FORWARD_RECORD_SIZE + 1]
+                               [GRAD_FORWARD_REPLAY_LANES];
+
+static size_t grad__forward_record_node(size_t left,
+                                        grad_real_t left_partial,
+                                        size_t right,
+                                        grad_real_t right_partial) {
+  assert(grad__forward_nodes < GRAD_FORWARD_RECORD_SIZE);
+  grad__forward_entry_t *entry =
+      &grad__forward_entries[grad__forward_entry_count++];
+  entry->result = ++grad__forward_nodes;
+  entry->left = left;
+  entry->left_partial = left_partial;
+  entry->right = right;
+  entry->right_partial = right_partial;
+  return entry->result;
+}
+
+static void grad__forward_record(grad_forward_t *result,
+                                 const grad_forward_t *left,
+                                 grad_real_t left_partial,
+                                 const grad_forward_t *right,
+                                 grad_real_t right_partial) {
+  if (!grad__forward_recording) {
+    return;
+  }
+  result->node = grad__forward_record_node(
+      left->node, left_partial, right ? right->node : 0,
+      right ? right_partial : (grad_real_t)0.0);
+}
+
+void grad_forward_record_start(void) {
+  grad__forward_recording = 1;
+  grad__forward_nodes = 0;
+  grad__forward_entry_count = 0;
+  grad__forward_input_count = 0;
+}
+
+void grad_forward_record_stop(void) { grad__forward_recording = 0; }
+
+static void grad__forward_stream(const grad__forward_entry_t *entries,
+                                 size_t count,
+                                 grad_real_t (*t)[GRAD_FORWARD_REPLAY_LANES],
+                                 size_t lanes) {
+  for (size_t e = 0; e < count; ++e) {
+    const grad__forward_entry_t *entry = &entries[e];
+    const grad_real_t *l = t[entry->left];
+    const grad_real_t *r = t[entry->right];
+    grad_real_t *result = t[entry->result];
+    for (size_t k = 0; k < lanes; ++k) {
+      result[k] = entry->left_partial * l[k] + entry->right_partial * r[k];
+    }
+  }
+}
+
+void grad_forward_replay(const grad_forward_t *const *outputs,
+                         size_t n_outputs, const grad_real_t *seeds,
+                         size_t directions, grad_real_t *tangents) {
+  size_t width = grad_tune_get()->forward_lanes;
+  memset(grad__forward_lanes[0], 0, sizeof(grad__forward_lanes[0]));
+  for (size_t first = 0; first < directions; first += width) {
+    size_t lanes = directions - first < width ? directions - first : width;
+    for (size_t i = 0; i < grad__forward_input_count; ++i) {
+      const grad__forward_input_t *input = &grad__forward_inputs[i];
+      grad_real_t *t = grad__forward_lanes[input->node];
+      for (size_t k = 0; k < lanes; ++k) {
+        t[k] = seeds[input->id * directions + first + k];
+      }
+    }
+    grad__forward_stream(grad__forward_entries, grad__forward_entry_count,
+                         grad__forward_lanes, lanes);
+    for (size_t j = 0; j < n_outputs; ++j) {
+      const grad_real_t *t = grad__forward_lanes[outputs[j]->node];
+      for (size_t k = 0; k < lanes; ++k) {
+        tangents[j * directions + first + k] = t[k];
+      }
+    }
+  }
+}
+
+void grad_forward_start_scope() {
+  GRAD__TRACE(grad_trace_instant("forward_scope"));
+  grad_forward_current_id = 0;
+}
+
+grad_forward_t grad_forward_init(grad_real_t value) {
+  assert(grad_forward_current_id < GRAD_FORWARD_TAPE_SIZE);
+  grad_forward_t result = {0};
+  result.value = value;
+  memset(result.derivative, 0, sizeof(grad_real_t) * GRAD_FORWARD_TAPE_SIZE);
+  result.id = grad_forward_current_id;
+  result.derivative[grad_forward_current_id] = (grad_real_t)1.0;
+  result.active_begin = grad_forward_current_id;
+  result.active_end = grad_forward_current_id + 1;
+  if (grad__forward_recording) {
+    assert(grad__forward_nodes < GRAD_FORWARD_RECORD_SIZE);
+    result.node = ++grad__forward_nodes;
+    grad__forward_inputs[grad__forward_input_count].node = result.node;
+    grad__forward_inputs[grad__forward_input_count].id = result.id;
+    grad__forward_input_count += 1;
+  }
+  grad_forward_current_id += 1;
+  GRAD__STATS(if (grad_forward_current_id > grad__stats.forward_peak_id) {
+    grad__stats.forward_peak_id = grad_forward_current_id;
+  });
+  return result;
+}
+
+grad_forward_t grad_forward_constant(grad_real_t value) {
+  grad_forward_t result = {0};
+  result.value = value;
+  result.active_begin = GRAD_FORWARD_TAPE_SIZE;
+  result.active_end = GRAD_FORWARD_TAPE_SIZE;
+  return result;
+}
+
+// Active range of grad, with the unset range of a zero-initialised value
+// widened to every input id.
+static void grad__forward_range(const grad_forward_t *grad, size_t *begin,
+                                size_t *end) {
+  if (grad->active_begin == 0 && grad->active_end == 0) {
+    *begin = 0;
+    *end = grad_forward_current_id;
+  } else {
+    *begin = grad->active_begin;
+    *end = grad->active_end;
+  }
+}
+
+// Gives result the union of the active ranges of left and right (may be
+// NULL). Passive operands do not widen it.
+static void grad__forward_active(grad_forward_t *result,
+                                 const grad_forward_t *left,
+                                 const grad_forward_t *right) {
+  size_t begin;
+  size_t end;
+  grad__forward_range(left, &begin, &end);
+  if (right != NULL) {
+    size_t right_begin;
+    size_t right_end;
+    grad__forward_range(right, &right_begin, &right_end);
+    if (begin >= end) {
+      begin = right_begin;
+      end = right_end;
+    } else if (right_begin < right_end) {
+      begin = right_begin < begin ? right_begin : begin;
+      end = right_end > end ? right_end : end;
+    }
+  }
+  if (begin >= end) {
+    begin = GRAD_FORWARD_TAPE_SIZE;
+    end = GRAD_FORWARD_TAPE_SIZE;
+  }
+  result->active_begin = begin;
+  result->active_end = end;
+}
+
+grad_forward_t grad_forward_add(const grad_forward_t *left,
+                                const grad_forward_t *right) {
+  grad_forward_t result = {0};
+  result.value = left->value + right->value;
+  grad__forward_active(&result, left, right);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = left->derivative[i] + right->derivative[i];
+  }
+  grad__forward_record(&result, left, 1, right, 1);
+  return result;
+}
+
+grad_forward_t grad_forward_add_c(const grad_forward_t *grad,
+                                  grad_real_t constant) {
+  grad_forward_t result = {0};
+  result.value = grad->value + constant;
+  grad__forward_active(&result, grad, NULL);
+  memcpy(result.derivative + result.active_begin,
+         grad->derivative + result.active_begin,
+         sizeof(grad_real_t) * (result.active_end - result.active_begin));
+  grad__forward_record(&result, grad, 1, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_mul(const grad_forward_t *left,
+                                const grad_forward_t *right) {
+  grad_forward_t result = {0};
+  result.value = left->value * right->value;
+  grad__forward_active(&result, left, right);
+
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] =
+        left->derivative[i] * right->value + left->value * right->derivative[i];
+  }
+  grad__forward_record(&result, left, right->value, right, left->value);
+  return result;
+}
+
+grad_forward_t grad_forward_mul_c(const grad_forward_t *grad,
+                                  const grad_real_t constant) {
+  grad_forward_t result = {0};
+  result.value = grad->value * constant;
+  grad__forward_active(&result, grad, NULL);
+
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = constant * grad->derivative[i];
+  }
+  grad__forward_record(&result, grad, constant, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_inv(const grad_forward_t *grad) {
+  grad_forward_t result = {0};
+  result.value = (grad_real_t)1.0f / grad->value;
+
+  grad_real_t inv_sq = (grad_real_t)1.0 / (grad->value * grad->value);
+  grad__forward_active(&result, grad, NULL);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = -grad->derivative[i] * inv_sq;
+  }
+  grad__forward_record(&result, grad, -inv_sq, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_div(const grad_forward_t *left,
+                                const grad_forward_t *right) {
+  grad_forward_t right_inv = grad_forward_inv(right);
+  return grad_forward_mul(left, &right_inv);
+}
+
+grad_forward_t grad_forward_neg(const grad_forward_t *grad) {
+  return grad_forward_mul_c(grad, -1);
+}
+
+grad_forward_t grad_forward_sub(const grad_forward_t *left,
+                                const grad_forward_t *right) {
+  grad_forward_t right_neg = grad_forward_neg(right);
+  return grad_forward_add(left, &right_neg);
+}
+
+grad_forward_t grad_forward_exp(const grad_forward_t *grad) {
+  grad_forward_t result = {0};
+  result.value = GRAD_EXP(grad->value);
+  grad__forward_active(&result, grad, NULL);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = result.value * grad->derivative[i];
+  }
+  grad__forward_record(&result, grad, result.value, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_log(const grad_forward_t *grad) {
+  grad_forward_t result = {0};
+  result.value = GRAD_LOG(grad->value);
+  grad_real_t inv = (grad_real_t)1.0 / grad->value;
+  grad__forward_active(&result, grad, NULL);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = inv * grad->derivative[i];
+  }
+  grad__forward_record(&result, grad, inv, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_sin(const grad_forward_t *grad) {
+  grad_forward_t result = {0};
+  result.value = GRAD_SIN(grad->value);
+  grad_real_t val = GRAD_COS(grad->value);
+  grad__forward_active(&result, grad, NULL);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = val * grad->derivative[i];
+  }
+  grad__forward_record(&result, grad, val, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_cos(const grad_forward_t *grad) {
+  grad_forward_t result = {0};
+  result.value = GRAD_COS(grad->value);
+  grad_real_t val = -GRAD_SIN(grad->value);
+  grad__forward_active(&result, grad, NULL);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = val * grad->derivative[i];
+  }
+  grad__forward_record(&result, grad, val, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_tan(const grad_forward_t *grad) {
+  grad_forward_t s = grad_forward_sin(grad);
+  grad_forward_t c = grad_forward_cos(grad);
+  return grad_forward_div(&s, &c);
+}
+
+grad_forward_t grad_forward_sqrt(const grad_forward_t *grad) {
+  grad_forward_t result = {0};
+  result.value = GRAD_SQRT(grad->value);
+  grad_real_t inv = (grad_real_t)0.5 / result.value;
+  grad__forward_active(&result, grad, NULL);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = inv * grad->derivative[i];
+  }
+  grad__forward_record(&result, grad, inv, NULL, 0);
+  return result;
+}
+
+grad_forward_t grad_forward_pow(const grad_forward_t *grad, grad_real_t e) {
+  grad_forward_t result = {0};
+  result.value = GRAD_POW(grad->value, e);
+  grad_real_t val = GRAD_POW(grad->value, e - 1);
+  grad__forward_active(&result, grad, NULL);
+  for (size_t i = result.active_begin; i < result.active_end; i++) {
+    result.derivative[i] = e * val * grad->derivative[i];
+  }
+  grad__forward_record(&result, grad, e * val, NULL, 0);
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_init(const grad_real_t *value) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = value[l];
+    result.derivative[l] = (grad_real_t)1.0;
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_constant(grad_real_t value) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = value;
+    result.derivative[l] = (grad_real_t)0.0;
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_add(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = left->value[l] + right->value[l];
+    result.derivative[l] = left->derivative[l] + right->derivative[l];
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_add_c(const grad_forward_batch_t *grad,
+                                              grad_real_t constant) {
+  grad_forward_batch_t result = *grad;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] += constant;
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_mul(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = left->value[l] * right->value[l];
+    result.derivative[l] = left->derivative[l] * right->value[l] +
+                           left->value[l] * right->derivative[l];
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_mul_c(const grad_forward_batch_t *grad,
+                                              grad_real_t constant) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = grad->value[l] * constant;
+    result.derivative[l] = grad->derivative[l] * constant;
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_inv(const grad_forward_batch_t *grad) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = (grad_real_t)1.0 / grad->value[l];
+    result.derivative[l] = -grad->derivative[l] * result.value[l] *
+                           result.value[l];
+  }
   return result;
 }
 
-grad_reverse_t *grad_reverse_mul(grad_reverse_t *left, grad_reverse_t *right) {
-  grad_reverse_t *result = grad_reverse_init(left->value * right->value);
-  result->operation = GRAD_OP_MUL;
-  result->left = left;
-  result->right = right;
-  return result;
+grad_forward_batch_t grad_forward_batch_div(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right) {
+  grad_forward_batch_t right_inv = grad_forward_batch_inv(right);
+  return grad_forward_batch_mul(left, &right_inv);
+}
+
+grad_forward_batch_t grad_forward_batch_neg(const grad_forward_batch_t *grad) {
+  return grad_forward_batch_mul_c(grad, -1);
+}
+
+grad_forward_batch_t grad_forward_batch_sub(const grad_forward_batch_t *left,
+                                            const grad_forward_batch_t *right) {
+  grad_forward_batch_t right_neg = grad_forward_batch_neg(right);
+  return grad_forward_batch_add(left, &right_neg);
+}
+
+grad_forward_batch_t grad_forward_batch_exp(const grad_forward_batch_t *grad) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = GRAD_EXP(grad->value[l]);
+    result.derivative[l] = result.value[l] * grad->derivative[l];
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_log(const grad_forward_batch_t *grad) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = GRAD_LOG(grad->value[l]);
+    result.derivative[l] = grad->derivative[l] / grad->value[l];
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_sin(const grad_forward_batch_t *grad) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = GRAD_SIN(grad->value[l]);
+    result.derivative[l] = GRAD_COS(grad->value[l]) * grad->derivative[l];
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_cos(const grad_forward_batch_t *grad) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = GRAD_COS(grad->value[l]);
+    result.derivative[l] = -GRAD_SIN(grad->value[l]) * grad->derivative[l];
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_sqrt(const grad_forward_batch_t *grad) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = GRAD_SQRT(grad->value[l]);
+    result.derivative[l] =
+        (grad_real_t)0.5 / result.value[l] * grad->derivative[l];
+  }
+  return result;
+}
+
+grad_forward_batch_t grad_forward_batch_pow(const grad_forward_batch_t *grad,
+                                            grad_real_t e) {
+  grad_forward_batch_t result;
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    result.value[l] = GRAD_POW(grad->value[l], e);
+    result.derivative[l] =
+        e * GRAD_POW(grad->value[l], e - 1) * grad->derivative[l];
+  }
+  return result;
+}
+
+grad_newton_batch_t grad_newton_batch(grad_newton_batch_fn_t fn, void *user,
+                                      size_t n, grad_real_t *x,
+                                      grad_real_t tol, size_t max_iter,
+                                      size_t *iterations) {
+  GRAD__TRACE(grad_trace_begin("newton_batch"));
+  grad_newton_batch_t report = {0};
+  size_t problem[GRAD_FORWARD_BATCH_WIDTH];
+  size_t steps[GRAD_FORWARD_BATCH_WIDTH];
+  grad_real_t value[GRAD_FORWARD_BATCH_WIDTH];
+  size_t next = 0;
+  size_t busy = 0;
+
+  // Idle lanes keep evaluating the last iterate they held; f is ignored.
+  for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+    problem[l] = GRAD_NEWTON_IDLE;
+    value[l] = n > 0 ? x[0] : (grad_real_t)0.0;
+    if (next < n) {
+      problem[l] = next;
+      value[l] = x[next++];
+      steps[l] = 0;
+      busy += 1;
+    }
+  }
+
+  while (busy > 0) {
+    grad_forward_batch_t input = grad_forward_batch_init(value);
+    grad_forward_batch_t f;
+    fn(&input, problem, &f, user);
+    report.sweeps += 1;
+    report.lane_steps += busy;
+
+    grad_real_t step[GRAD_FORWARD_BATCH_WIDTH];
+    for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+      step[l] = f.value[l] / f.derivative[l];
+    }
+    for (size_t l = 0; l < GRAD_FORWARD_BATCH_WIDTH; ++l) {
+      if (problem[l] == GRAD_NEWTON_IDLE) {
+        continue;
+      }
+      int finite = isfinite(step[l]);
+      int converged = finite && fabs((double)step[l]) < (double)tol;
+      if (finite) {
+        value[l] -= step[l];
+      }
+      steps[l] += 1;
+      if (!converged && finite && steps[l] < max_iter) {
+        continue;
+      }
+
+      x[problem[l]] = value[l];
+      if (iterations != NULL) {
+        iterations[problem[l]] = converged ? steps[l] : max_iter;
+      }
+      report.converged += (size_t)converged;
+      if (next < n) {
+        problem[l] = next;
+        value[l] = x[next++];
+        steps[l] = 0;
+      } else {
+        problem[l] = GRAD_NEWTON_IDLE;
+        busy -= 1;
+      }
+    }
+  }
+  GRAD__TRACE(grad_trace_end("newton_batch"));
+  return report;
+}
+
+typedef struct grad__blackbox_task_t {
+  const grad_blackbox_t *box;
+  const grad_real_t *x;
+  grad_real_t *jacobian;
+} grad__blackbox_task_t;
+
+#ifndef __STDC_NO_COMPLEX__
+// Real and imaginary parts, through the array layout C gives complex types,
+// which avoids creal/cimag and so <complex.h>.
+static grad_real_t *grad__complex_parts(grad_complex_t *z) {
+  return (grad_real_t *)z;
+}
+#endif // __STDC_NO_COMPLEX__
+
+// Columns [begin, end) of the Jacobian, one perturbed input each.
+static void grad__blackbox_columns(size_t begin, size_t end, void *user) {
+  const grad__blackbox_task_t *task = user;
+  const grad_blackbox_t *box = task->box;
+  size_t n = box->inputs;
+  size_t m = box->outputs;
+  grad_real_t *row = task->jacobian;
+
+#ifndef __STDC_NO_COMPLEX__
+  if (box->complex_fn != NULL) {
+    const grad_real_t h = (grad_real_t)1e-20;
+    grad_complex_t *x = malloc(sizeof(grad_complex_t) * (n + m));
+    assert(x);
+    grad_complex_t *y = x + n;
+    for (size_t j = 0; j < n; ++j) {
+      x[j] = task->x[j];
+    }
+    for (size_t j = begin; j < end; ++j) {
+      grad__complex_parts(&x[j])[1] = h;
+      box->complex_fn(x, y, box->user);
+      grad__complex_parts(&x[j])[1] = 0;
+      for (size_t k = 0; k < m; ++k) {
+        row[k * n + j] = grad__complex_parts(&y[k])[1] / h;
+      }
+    }
+    free(x);
+    return;
+  }
+#endif // __STDC_NO_COMPLEX__
+
+  // Central differences with the step that balances truncation against
+  // rounding, cbrt(epsilon) relative to the input.
+  const grad_real_t step = (grad_real_t)cbrt(
+      sizeof(grad_real_t) == sizeof(double) ? DBL_EPSILON : FLT_EPSILON);
+  grad_real_t *x = malloc(sizeof(grad_real_t) * (n + 2 * m));
+  assert(x);
+  grad_real_t *plus = x + n;
+  grad_real_t *minus = plus + m;
+  memcpy(x, task->x, sizeof(grad_real_t) * n);
+  for (size_t j = begin; j < end; ++j) {
+    grad_real_t scale = task->x[j] < 0 ? -task->x[j] : task->x[j];
+    grad_real_t h = step * (scale > 1 ? scale : 1);
+    volatile grad_real_t up = task->x[j] + h;
+    volatile grad_real_t down = task->x[j] - h;
+    x[j] = up;
+    box->fn(x, plus, box->user);
+    x[j] = down;
+    box->fn(x, minus, box->user);
+    x[j] = task->x[j];
+    for (size_t k = 0; k < m; ++k) {
+      row[k * n + j] = (plus[k] - minus[k]) / (up - down);
+    }
+  }
+  free(x);
+}
+
+static void grad__blackbox_values(const grad_blackbox_t *box,
+                                  const grad_real_t *x, grad_real_t *y) {
+#ifndef __STDC_NO_COMPLEX__
+  if (box->complex_fn != NULL) {
+    grad_complex_t *z =
+        malloc(sizeof(grad_complex_t) * (box->inputs + box->outputs + 1));
+    assert(z);
+    for (size_t j = 0; j < box->inputs; ++j) {
+      z[j] = x[j];
+    }
+    box->complex_fn(z, z + box->inputs, box->user);
+    for (size_t k = 0; k < box->outputs; ++k) {
+      y[k] = grad__complex_parts(&z[box->inputs + k])[0];
+    }
+    free(z);
+    return;
+  }
+#endif // __STDC_NO_COMPLEX__
+  assert(box->complex_fn == NULL);
+  box->fn(x, y, box->user);
+}
+
+// Values y and the outputs x inputs row-major Jacobian of box at x.
+static void grad__blackbox_jacobian(const grad_blackbox_t *box,
+                                    const grad_real_t *x, grad_real_t *y,
+                                    grad_real_t *jacobian) {
+  assert((box->fn != NULL) != (box->complex_fn != NULL));
+  grad__blackbox_values(box, x, y);
+  grad__blackbox_task_t task = {box, x, jacobian};
+  grad_parallel_for(box->inputs, 1, grad__blackbox_columns, &task);
+}
+
+void grad_forward_blackbox(const grad_blackbox_t *box,
+                           const grad_forward_t *inputs,
+                           grad_forward_t *outputs) {
+  size_t n = box->inputs;
+  size_t m = box->outputs;
+  grad_real_t *x = malloc(sizeof(grad_real_t) * (n + m + m * n + 1));
+  assert(x);
+  grad_real_t *y = x + n;
+  grad_real_t *jacobian = y + m;
+  for (size_t j = 0; j < n; ++j) {
+    x[j] = inputs[j].value;
+  }
+  grad__blackbox_jacobian(box, x, y, jacobian);
+
+  for (size_t k = 0; k < m; ++k) {
+    grad_forward_t *result = &outputs[k];
+    const grad_real_t *row = &jacobian[k * n];
+    result->id = 0;
+    result->value = y[k];
+    result->node = 0;
+    result->active_begin = GRAD_FORWARD_TAPE_SIZE;
+    result->active_end = GRAD_FORWARD_TAPE_SIZE;
+    memset(result->derivative, 0, sizeof(result->derivative));
+    for (size_t j = 0; j < n; ++j) {
+      const grad_forward_t *input = &inputs[j];
+      grad__forward_active(result, result, input);
+      size_t begin;
+      size_t end;
+      grad__forward_range(input, &begin, &end);
+      for (size_t i = begin; i < end; ++i) {
+        result->derivative[i] += row[j] * input->derivative[i];
+      }
+    }
+    // Recorded as a chain of two-operand multiply-adds.
+    if (grad__forward_recording && n > 0) {
+      size_t node = grad__forward_record_node(
+          inputs[0].node, row[0], n > 1 ? inputs[1].node : 0,
+          n > 1 ? row[1] : (grad_real_t)0.0);
+      for (size_t j = 2; j < n; ++j) {
+        node = grad__forward_record_node(node, 1, inputs[j].node, row[j]);
+      }
+      result->node = node;
+    }
+  }
+  free(x);
+}
+
+grad_reverse_t grad_reverse_tape[GRAD_REVERSE_TAPE_SIZE];
+size_t grad_reverse_current_id = 0;
+
+typedef struct grad__reverse_binding_t {
+  size_t begin;
+  size_t size;
+  const grad_real_t *values;
+  grad_real_t *gradients;
+} grad__reverse_binding_t;
+
+grad__reverse_binding_t grad__reverse_bindings[GRAD_REVERSE_BINDINGS];
+size_t grad__reverse_binding_count = 0;
+// One grad_reverse_blackbox call: its operands, output nodes and Jacobian.
+typedef struct grad__blackbox_group_t {
+  grad_blackbox_t box;
+  grad_reverse_t **operands;
+  grad_reverse_t **results;
+  grad_real_t *jacobian;
+} grad__blackbox_group_t;
+
+// One entry per GRAD_OP_BLACKBOX node, sorted by node index.
+typedef struct grad__blackbox_entry_t {
+  size_t node;
+  size_t output;
+  grad__blackbox_group_t *group;
+} grad__blackbox_entry_t;
+
+grad__blackbox_entry_t *grad__blackbox_entries = NULL;
+size_t grad__blackbox_entry_count = 0;
+size_t grad__blackbox_entry_capacity = 0;
+grad__blackbox_group_t **grad__blackbox_groups = NULL;
+size_t grad__blackbox_group_count = 0;
+size_t grad__blackbox_group_capacity = 0;
+
+// Set while every bound leaf's derivative is known to be zero.
+int grad__reverse_bound_clean = 0;
+unsigned char grad__reverse_touched[GRAD_REVERSE_TAPE_SIZE];
+
+void grad_reverse_start_scope() {
+  GRAD__PERF(grad__perf_switch(GRAD__PERF_RECORD, grad_reverse_current_id));
+  GRAD__METRICS(grad__metrics_add(&grad__metrics->tapes, 1));
+  GRAD__METRICS(grad__metrics_peak(grad_reverse_current_id));
+#ifdef GRAD_TRACE
+  if (grad__trace_recording) {
+    grad_trace_end("record");
+  }
+  grad_trace_instant("reverse_scope");
+  grad_trace_begin("record");
+  grad__trace_recording = 1;
+#endif // GRAD_TRACE
+  grad_reverse_current_id = 0;
+  grad__reverse_binding_count = 0;
+  grad__reverse_bound_clean = 1;
+  for (size_t g = 0; g < grad__blackbox_group_count; ++g) {
+    free(grad__blackbox_groups[g]);
+  }
+  grad__blackbox_group_count = 0;
+  grad__blackbox_entry_count = 0;
+}
+
+grad_reverse_t *grad_reverse_init(grad_real_t value) {
+  assert(grad_reverse_current_id < GRAD_REVERSE_TAPE_SIZE);
+  grad_reverse_t *result = &grad_reverse_tape[grad_reverse_current_id];
+  grad_reverse_current_id += 1;
+  GRAD__STATS(if (grad_reverse_current_id > grad__stats.reverse_peak_id) {
+    grad__stats.reverse_peak_id = grad_reverse_current_id;
+  });
+  GRAD__SOURCE(grad__reverse_source[result - grad_reverse_tape] =
+                   (uint32_t)grad__source_current);
+  GRAD__SOURCE(grad__source_locations[grad__source_current].nodes += 1);
+
+  result->value = value;
+  result->operation = GRAD_OP_NONE;
+  result->derivative = (grad_real_t)0.0;
+
+  return result;
+}
+
+grad_reverse_t *grad_reverse_bind(const grad_real_t *values,
+                                  grad_real_t *gradients, size_t n) {
+  assert(grad_reverse_current_id + n <= GRAD_REVERSE_TAPE_SIZE);
+  assert(grad__reverse_binding_count < GRAD_REVERSE_BINDINGS);
+  size_t begin = grad_reverse_current_id;
+  grad__reverse_binding_t *binding =
+      &grad__reverse_bindings[grad__reverse_binding_count++];
+  binding->begin = begin;
+  binding->size = n;
+  binding->values = values;
+  binding->gradients = gradients;
+
+  grad_reverse_t *block = &grad_reverse_tape[begin];
+  for (size_t i = 0; i < n; ++i) {
+    block[i].value = values[i];
+    block[i].derivative = (grad_real_t)0.0;
+    block[i].operation = GRAD_OP_NONE;
+    GRAD__SOURCE(grad__reverse_source[begin + i] =
+                     (uint32_t)grad__source_current);
+  }
+  GRAD__SOURCE(grad__source_locations[grad__source_current].nodes += n);
+  grad_reverse_current_id += n;
+  GRAD__STATS(if (grad_reverse_current_id > grad__stats.reverse_peak_id) {
+    grad__stats.reverse_peak_id = grad_reverse_current_id;
+  });
+  return block;
+}
+
+static void grad__reverse_bindings_load(void) {
+  for (size_t b = 0; b < grad__reverse_binding_count; ++b) {
+    const grad__reverse_binding_t *binding = &grad__reverse_bindings[b];
+    grad_reverse_t *block = &grad_reverse_tape[binding->begin];
+    for (size_t i = 0; i < binding->size; ++i) {
+      block[i].value = binding->values[i];
+    }
+  }
+}
+
+static const grad__blackbox_entry_t *grad__blackbox_find(size_t node) {
+  size_t low = 0;
+  size_t high = grad__blackbox_entry_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (grad__blackbox_entries[middle].node < node) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  assert(low < grad__blackbox_entry_count &&
+         grad__blackbox_entries[low].node == node);
+  return &grad__blackbox_entries[low];
+}
+
+// Re-evaluates a group from its operands' current values.
+static void grad__blackbox_evaluate(grad__blackbox_group_t *group) {
+  size_t n = group->box.inputs;
+  size_t m = group->box.outputs;
+  grad_real_t *x = malloc(sizeof(grad_real_t) * (n + m + 1));
+  assert(x);
+  for (size_t j = 0; j < n; ++j) {
+    x[j] = group->operands[j]->value;
+  }
+  grad__blackbox_jacobian(&group->box, x, x + n, group->jacobian);
+  for (size_t k = 0; k < m; ++k) {
+    group->results[k]->value = x[n + k];
+  }
+  free(x);
+}
+
+void grad_reverse_blackbox(const grad_blackbox_t *box,
+                           grad_reverse_t *const *inputs,
+                           grad_reverse_t **outputs) {
+  size_t n = box->inputs;
+  size_t m = box->outputs;
+  grad__blackbox_group_t *group =
+      malloc(sizeof(grad__blackbox_group_t) +
+             sizeof(grad_reverse_t *) * (n + m) + sizeof(grad_real_t) * m * n);
+  assert(group);
+  group->box = *box;
+  group->operands = (grad_reverse_t **)(group + 1);
+  group->results = group->operands + n;
+  group->jacobian = (grad_real_t *)(group->results + m);
+  memcpy(group->operands, inputs, sizeof(grad_reverse_t *) * n);
+
+  if (grad__blackbox_group_count == grad__blackbox_group_capacity) {
+    grad__blackbox_group_capacity = 2 * grad__blackbox_group_capacity + 8;
+    grad__blackbox_groups =
+        realloc(grad__blackbox_groups, sizeof(grad__blackbox_group_t *) *
+                                           grad__blackbox_group_capacity);
+    assert(grad__blackbox_groups);
+  }
+  grad__blackbox_groups[grad__blackbox_group_count++] = group;
+
+  for (size_t k = 0; k < m; ++k) {
+    grad_reverse_t *result = grad_reverse_init(0);
+    result->operation = GRAD_OP_BLACKBOX;
+    result->left = NULL;
+    result->right = NULL;
+    group->results[k] = result;
+    outputs[k] = result;
+
+    if (grad__blackbox_entry_count == grad__blackbox_entry_capacity) {
+      grad__blackbox_entry_capacity = 2 * grad__blackbox_entry_capacity + 8;
+      grad__blackbox_entries =
+          realloc(grad__blackbox_entries, sizeof(grad__blackbox_entry_t) *
+                                              grad__blackbox_entry_capacity);
+      assert(grad__blackbox_entries);
+    }
+    grad__blackbox_entry_t *entry =
+        &grad__blackbox_entries[grad__blackbox_entry_count++];
+    entry->node = (size_t)(result - grad_reverse_tape);
+    entry->output = k;
+    entry->group = group;
+  }
+  grad__blackbox_evaluate(group);
+}
+
+static void grad__reverse_bindings_store(void) {
+  for (size_t b = 0; b < grad__reverse_binding_count; ++b) {
+    const grad__reverse_binding_t *binding = &grad__reverse_bindings[b];
+    const grad_reverse_t *block = &grad_reverse_tape[binding->begin];
+    for (size_t i = 0; binding->gradients && i < binding->size; ++i) {
+      binding->gradients[i] = block[i].derivative;
+    }
+  }
+}
+
+grad_reverse_t *grad_reverse_add(grad_reverse_t *left, grad_reverse_t *right) {
+  grad_reverse_t *result = grad_reverse_init(left->value + right->value);
+  result->operation = GRAD_OP_ADD;
+  result->left = left;
+  result->right = right;
+  return result;
+}
+
+grad_reverse_t *grad_reverse_mul(grad_reverse_t *left, grad_reverse_t *right) {
+  grad_reverse_t *result = grad_reverse_init(left->value * right->value);
+  result->operation = GRAD_OP_MUL;
+  result->left = left;
+  result->right = right;
+  return result;
+}
+
+grad_reverse_t *grad_reverse_neg(grad_reverse_t *grad) {
+  grad_reverse_t *result = grad_reverse_init(-grad->value);
+  result->operation = GRAD_OP_NEG;
+  result->left = grad;
+  return result;
+}
+
+grad_reverse_t *grad_reverse_inv(grad_reverse_t *grad) {
+  grad_reverse_t *result = grad_reverse_init(1.0 / grad->value);
+  result->operation = GRAD_OP_INV;
+  result->left = grad;
+  return result;
+}
+
+grad_reverse_t *grad_reverse_sub(grad_reverse_t *left, grad_reverse_t *right) {
+  grad_reverse_t *neg_right = grad_reverse_neg(right);
+  return grad_reverse_add(left, neg_right);
+}
+
+grad_reverse_t *grad_reverse_div(grad_reverse_t *left, grad_reverse_t *right) {
+  grad_reverse_t *inv_right = grad_reverse_inv(right);
+  return grad_reverse_mul(left, inv_right);
+}
+
+grad_reverse_t *grad_reverse_sin(grad_reverse_t *grad) {
+  grad_reverse_t *result = grad_reverse_init(GRAD_SIN(grad->value));
+  result->operation = GRAD_OP_SIN;
+  result->left = grad;
+  return result;
+}
+
+grad_reverse_t *grad_reverse_cos(grad_reverse_t *grad) {
+  grad_reverse_t *result = grad_reverse_init(GRAD_COS(grad->value));
+  result->operation = GRAD_OP_COS;
+  result->left = grad;
+  return result;
+}
+
+grad_reverse_t *grad_reverse_exp(grad_reverse_t *grad) {
+  grad_reverse_t *result = grad_reverse_init(GRAD_EXP(grad->value));
+  result->operation = GRAD_OP_EXP;
+  result->left = grad;
+  return result;
+}
+
+grad_reverse_t *grad_reverse_log(grad_reverse_t *grad) {
+  grad_reverse_t *result = grad_reverse_init(GRAD_LOG(grad->value));
+  result->operation = GRAD_OP_LOG;
+  result->left = grad;
+  return result;
+}
+
+static size_t grad__reverse_arity(grad_reverse_op_t operation) {
+  switch (operation) {
+  case GRAD_OP_ADD:
+  case GRAD_OP_MUL:
+    return 2;
+  case GRAD_OP_NEG:
+  case GRAD_OP_INV:
+  case GRAD_OP_SIN:
+  case GRAD_OP_COS:
+  case GRAD_OP_EXP:
+  case GRAD_OP_LOG:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Operand count and k-th operand of a node, including black-box inputs.
+static size_t grad__reverse_node_arity(const grad_reverse_t *grad) {
+  if (grad->operation == GRAD_OP_BLACKBOX) {
+    return grad__blackbox_find((size_t)(grad - grad_reverse_tape))
+        ->group->box.inputs;
+  }
+  return grad__reverse_arity(grad->operation);
+}
+
+static grad_reverse_t *grad__reverse_operand(const grad_reverse_t *grad,
+                                             size_t k) {
+  if (grad->operation == GRAD_OP_BLACKBOX) {
+    return grad__blackbox_find((size_t)(grad - grad_reverse_tape))
+        ->group->operands[k];
+  }
+  return k == 0 ? grad->left : grad->right;
+}
+
+static grad_real_t grad__reverse_apply(grad_reverse_op_t operation,
+                                       grad_real_t left, grad_real_t right) {
+  switch (operation) {
+  case GRAD_OP_ADD:
+    return left + right;
+  case GRAD_OP_MUL:
+    return left * right;
+  case GRAD_OP_NEG:
+    return -left;
+  case GRAD_OP_INV:
+    return 1.0 / left;
+  case GRAD_OP_SIN:
+    return GRAD_SIN(left);
+  case GRAD_OP_COS:
+    return GRAD_COS(left);
+  case GRAD_OP_EXP:
+    return GRAD_EXP(left);
+  case GRAD_OP_LOG:
+    return GRAD_LOG(left);
+  default:
+    return left;
+  }
+}
+
+static grad_real_t grad__remat_value(const grad_reverse_remat_t *plan,
+                                     const grad_real_t *store,
+                                     const grad_reverse_t *node) {
+  size_t slot = plan->slot[node - grad_reverse_tape];
+  if (slot != GRAD_REMAT_RECOMPUTE) {
+    assert(slot != GRAD_REMAT_DEAD);
+    return store[slot];
+  }
+  grad_real_t left = grad__remat_value(plan, store, node->left);
+  grad_real_t right = grad__reverse_arity(node->operation) > 1
+                          ? grad__remat_value(plan, store, node->right)
+                          : 0;
+  return grad__reverse_apply(node->operation, left, right);
+}
+
+// Primal value of an operand during a sweep: from the tape, or from a remat
+// store when plan is not NULL.
+static grad_real_t grad__reverse_sweep_value(const grad_reverse_remat_t *plan,
+                                             const grad_real_t *store,
+                                             const grad_reverse_t *node) {
+  return plan ? grad__remat_value(plan, store, node) : node->value;
+}
+
+static void grad__reverse_sweep_values(size_t begin, size_t end,
+                                       const grad_reverse_remat_t *plan,
+                                       const grad_real_t *store) {
+  GRAD__TRACE(grad_trace_begin("sweep"));
+
+  for (ssize_t i = (ssize_t)end - 1; i >= (ssize_t)begin; --i) {
+    grad_reverse_t *grad = &grad_reverse_tape[i];
+
+#ifdef GRAD__SAMPLING
+    double sample_start = 0;
+    if (--grad__sample_countdown == 0) {
+      sample_start = grad__now_seconds();
+    }
+#endif // GRAD__SAMPLING
+    GRAD__STATS(grad__stats.backward_nodes[grad->operation] += 1);
+    GRAD__SOURCE(grad__source_backward(i, grad->derivative));
+
+    switch (grad->operation) {
+    case GRAD_OP_ADD: {
+      grad->left->derivative += grad->derivative;
+      grad->right->derivative += grad->derivative;
+      break;
+    }
+    case GRAD_OP_MUL: {
+      grad_real_t left = grad__reverse_sweep_value(plan, store, grad->left);
+      grad_real_t right = grad__reverse_sweep_value(plan, store, grad->right);
+      grad->left->derivative += right * grad->derivative;
+      grad->right->derivative += left * grad->derivative;
+      break;
+    }
+    case GRAD_OP_NEG: {
+      grad->left->derivative += -1.0 * grad->derivative;
+      break;
+    }
+    case GRAD_OP_INV: {
+      grad_real_t left = grad__reverse_sweep_value(plan, store, grad->left);
+      grad->left->derivative += -grad->derivative / (left * left);
+      break;
+    }
+    case GRAD_OP_SIN: {
+      grad_real_t left = grad__reverse_sweep_value(plan, store, grad->left);
+      grad->left->derivative += GRAD_COS(left) * grad->derivative;
+      break;
+    }
+    case GRAD_OP_COS: {
+      grad_real_t left = grad__reverse_sweep_value(plan, store, grad->left);
+      grad->left->derivative += -GRAD_SIN(left) * grad->derivative;
+      break;
+    }
+    case GRAD_OP_EXP: {
+      grad_real_t left = grad__reverse_sweep_value(plan, store, grad->left);
+      grad->left->derivative += GRAD_EXP(left) * grad->derivative;
+      break;
+    }
+    case GRAD_OP_LOG: {
+      grad_real_t left = grad__reverse_sweep_value(plan, store, grad->left);
+      grad->left->derivative += grad->derivative / left;
+      break;
+    }
+    case GRAD_OP_BLACKBOX: {
+      const grad__blackbox_entry_t *entry = grad__blackbox_find((size_t)i);
+      const grad__blackbox_group_t *group = entry->group;
+      size_t n = group->box.inputs;
+      GRAD__STATS(grad__stats.backward_blackbox_operands += n);
+      const grad_real_t *row = &group->jacobian[entry->output * n];
+      for (size_t j = 0; j < n; ++j) {
+        group->operands[j]->derivative += row[j] * grad->derivative;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+
+#ifdef GRAD__SAMPLING
+    if (grad__sample_countdown == 0) {
+      double elapsed = grad__now_seconds() - sample_start;
+      elapsed -= grad__sample_timer_overhead();
+      elapsed = elapsed > 0 ? elapsed : 0;
+      GRAD__STATS(grad__stats.backward_samples[grad->operation] += 1);
+      GRAD__STATS(grad__stats.backward_sampled_seconds[grad->operation] +=
+                  elapsed);
+      GRAD__SOURCE(grad__source_sample(i, elapsed));
+      grad__sample_countdown = GRAD_STATS_SAMPLE_PERIOD;
+    }
+#endif // GRAD__SAMPLING
+  }
+
+  GRAD__TRACE(grad_trace_end("sweep"));
+}
+
+static void grad__reverse_sweep(size_t begin, size_t end) {
+  grad__reverse_sweep_values(begin, end, NULL, NULL);
+}
+
+static void grad__reverse_backward_begin(void) {
+  GRAD__STATS(grad__stats.backward_sweeps += 1);
+  GRAD__PERF(grad__perf_switch(GRAD__PERF_BACKWARD, grad_reverse_current_id));
+  GRAD__METRICS(grad__metrics_backward_start = grad__now_ns());
+#ifdef GRAD_TRACE
+  if (grad__trace_recording) {
+    grad_trace_end("record");
+    grad__trace_recording = 0;
+  }
+  grad_trace_begin("backward");
+#endif // GRAD_TRACE
+}
+
+static void grad__reverse_backward_end(void) {
+  GRAD__TRACE(grad_trace_end("backward"));
+  GRAD__PERF(grad__perf_switch(GRAD__PERF_IDLE, grad_reverse_current_id));
+  GRAD__METRICS(grad__metrics_backward(
+      grad__now_ns() - grad__metrics_backward_start, grad_reverse_current_id));
+}
+
+void grad_reverse_backward(grad_reverse_t *output) {
+  grad__reverse_backward_begin();
+
+  for (size_t i = 0; i < grad_reverse_current_id; ++i) {
+    grad_reverse_tape[i].derivative = (grad_real_t)0.0;
+  }
+  grad__reverse_bound_clean = 0;
+
+  output->derivative = 1.0;
+
+  grad__reverse_sweep(0, grad_reverse_current_id);
+  grad__reverse_bindings_store();
+
+  grad__reverse_backward_end();
+}
+
+static int grad__reverse_is_bound(size_t i) {
+  for (size_t b = 0; b < grad__reverse_binding_count; ++b) {
+    const grad__reverse_binding_t *binding = &grad__reverse_bindings[b];
+    if (i - binding->begin < binding->size) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Calls fn on each stretch of the tape between bound blocks, last first.
+// Blocks are recorded in tape order and reordering keeps them sorted.
+static void grad__reverse_for_gaps(void (*fn)(size_t begin, size_t end)) {
+  size_t end = grad_reverse_current_id;
+  for (size_t b = grad__reverse_binding_count; b-- > 0;) {
+    const grad__reverse_binding_t *binding = &grad__reverse_bindings[b];
+    fn(binding->begin + binding->size, end);
+    end = binding->begin;
+  }
+  fn(0, end);
+}
+
+// First index from i on outside the bound blocks; b tracks the next block.
+static size_t grad__reverse_skip_bound(size_t i, size_t *b) {
+  while (*b < grad__reverse_binding_count &&
+         grad__reverse_bindings[*b].begin <= i) {
+    const grad__reverse_binding_t *binding = &grad__reverse_bindings[*b];
+    i = binding->begin + binding->size > i ? binding->begin + binding->size
+                                           : i;
+    *b += 1;
+  }
+  return i;
+}
+
+static void grad__reverse_zero_range(size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    grad_reverse_tape[i].derivative = (grad_real_t)0.0;
+  }
+}
+
+static void grad__reverse_touch(const grad_reverse_t *operand, size_t *index,
+                                grad_real_t *value, size_t capacity,
+                                size_t *count) {
+  size_t i = operand - grad_reverse_tape;
+  if (operand->operation != GRAD_OP_NONE || grad__reverse_touched[i]) {
+    return;
+  }
+  grad__reverse_touched[i] = 1;
+  if (*count < capacity) {
+    index[*count] = i;
+    value[*count] = operand->derivative;
+  }
+  *count += 1;
+}
+
+size_t grad_reverse_backward_sparse(grad_reverse_t *output, size_t *index,
+                                    grad_real_t *value, size_t capacity) {
+  grad__reverse_backward_begin();
+  if (!grad__reverse_bound_clean) {
+    for (size_t b = 0; b < grad__reverse_binding_count; ++b) {
+      const grad__reverse_binding_t *binding = &grad__reverse_bindings[b];
+      grad__reverse_zero_range(binding->begin,
+                               binding->begin + binding->size);
+    }
+  }
+  grad__reverse_for_gaps(grad__reverse_zero_range);
+  output->derivative = 1.0;
+  grad__reverse_for_gaps(grad__reverse_sweep);
+
+  // Leaves are only ever written through the operands of ops, so scanning
+  // the ops finds every leaf that received a contribution.
+  size_t count = 0;
+  size_t b = 0;
+  for (size_t i = grad__reverse_skip_bound(0, &b); i < grad_reverse_current_id;
+       i = grad__reverse_skip_bound(i + 1, &b)) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    if (grad->derivative == 0) {
+      continue;
+    }
+    size_t arity = grad__reverse_node_arity(grad);
+    for (size_t k = 0; k < arity; ++k) {
+      grad__reverse_touch(grad__reverse_operand(grad, k), index, value,
+                          capacity, &count);
+    }
+  }
+  b = 0;
+  for (size_t i = grad__reverse_skip_bound(0, &b); i < grad_reverse_current_id;
+       i = grad__reverse_skip_bound(i + 1, &b)) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    size_t arity = grad__reverse_node_arity(grad);
+    for (size_t k = 0; k < arity; ++k) {
+      grad_reverse_t *operand = grad__reverse_operand(grad, k);
+      size_t j = operand - grad_reverse_tape;
+      if (grad__reverse_touched[j]) {
+        grad__reverse_touched[j] = 0;
+        if (grad__reverse_is_bound(j)) {
+          operand->derivative = (grad_real_t)0.0;
+        }
+      }
+    }
+  }
+  grad__reverse_bound_clean = 1;
+  grad__reverse_backward_end();
+  return count;
+}
+
+static void grad__graph_accumulate(grad_reverse_t **adjoint,
+                                   const grad_reverse_t *node,
+                                   grad_reverse_t *term) {
+  grad_reverse_t **slot = &adjoint[node - grad_reverse_tape];
+  *slot = *slot ? grad_reverse_add(*slot, term) : term;
+}
+
+static grad_reverse_t *grad__graph_scale(grad_reverse_t *adjoint,
+                                         const grad_reverse_t *one,
+                                         grad_reverse_t *factor) {
+  return adjoint == one ? factor : grad_reverse_mul(adjoint, factor);
+}
+
+void grad_reverse_backward_graph(grad_reverse_t *output,
+                                 grad_reverse_t *const *inputs, size_t n,
+                                 grad_reverse_t **gradients) {
+  size_t end = grad_reverse_current_id;
+  grad_reverse_t **adjoint = calloc(end, sizeof(grad_reverse_t *));
+  assert(adjoint);
+  grad_reverse_t *one = grad_reverse_init(1.0);
+  adjoint[output - grad_reverse_tape] = one;
+
+  for (size_t i = end; i-- > 0;) {
+    grad_reverse_t *grad = &grad_reverse_tape[i];
+    grad_reverse_t *a = adjoint[i];
+    if (a == NULL) {
+      continue;
+    }
+    switch (grad->operation) {
+    case GRAD_OP_ADD: {
+      grad__graph_accumulate(adjoint, grad->left, a);
+      grad__graph_accumulate(adjoint, grad->right, a);
+      break;
+    }
+    case GRAD_OP_MUL: {
+      grad__graph_accumulate(adjoint, grad->left,
+                             grad__graph_scale(a, one, grad->right));
+      grad__graph_accumulate(adjoint, grad->right,
+                             grad__graph_scale(a, one, grad->left));
+      break;
+    }
+    case GRAD_OP_NEG: {
+      grad__graph_accumulate(adjoint, grad->left, grad_reverse_neg(a));
+      break;
+    }
+    case GRAD_OP_INV: {
+      grad_reverse_t *square = grad_reverse_mul(grad, grad);
+      grad__graph_accumulate(
+          adjoint, grad->left,
+          grad_reverse_neg(grad__graph_scale(a, one, square)));
+      break;
+    }
+    case GRAD_OP_SIN: {
+      grad__graph_accumulate(
+          adjoint, grad->left,
+          grad__graph_scale(a, one, grad_reverse_cos(grad->left)));
+      break;
+    }
+    case GRAD_OP_COS: {
+      grad__graph_accumulate(
+          adjoint, grad->left,
+          grad_reverse_neg(
+              grad__graph_scale(a, one, grad_reverse_sin(grad->left))));
+      break;
+    }
+    case GRAD_OP_EXP: {
+      grad__graph_accumulate(adjoint, grad->left,
+                             grad__graph_scale(a, one, grad));
+      break;
+    }
+    case GRAD_OP_LOG: {
+      grad__graph_accumulate(
+          adjoint, grad->left,
+          grad__graph_scale(a, one, grad_reverse_inv(grad->left)));
+      break;
+    }
+    case GRAD_OP_BLACKBOX: {
+      // The Jacobian enters as constants, so derivatives of this adjoint
+      // stop at the black box.
+      const grad__blackbox_entry_t *entry = grad__blackbox_find(i);
+      const grad__blackbox_group_t *group = entry->group;
+      size_t inputs_n = group->box.inputs;
+      const grad_real_t *row = &group->jacobian[entry->output * inputs_n];
+      for (size_t j = 0; j < inputs_n; ++j) {
+        grad__graph_accumulate(
+            adjoint, group->operands[j],
+            grad__graph_scale(a, one, grad_reverse_init(row[j])));
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  grad_reverse_t *zero = NULL;
+  for (size_t i = 0; i < n; ++i) {
+    gradients[i] = adjoint[inputs[i] - grad_reverse_tape];
+    if (gradients[i] == NULL) {
+      zero = zero ? zero : grad_reverse_init(0.0);
+      gradients[i] = zero;
+    }
+  }
+  free(adjoint);
+}
+
+#ifdef GRAD_STATS
+grad_stats_t grad_stats_get(void) {
+  grad_stats_t stats = grad__stats;
+  memset(stats.nodes, 0, sizeof(stats.nodes));
+  stats.record_bytes_read = 0;
+  for (size_t i = 0; i < grad_reverse_current_id; ++i) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    stats.nodes[grad->operation] += 1;
+    stats.record_bytes_read +=
+        grad__reverse_node_arity(grad) * sizeof(grad_real_t);
+  }
+  stats.record_bytes_written = grad_reverse_current_id * sizeof(grad_reverse_t);
+
+  // Every swept node is read whole and has its adjoint cleared beforehand.
+  // Each operand adjoint is read and written, and MUL and the transcendental
+  // ops also read operand values. Black boxes read a Jacobian entry per
+  // operand instead.
+  stats.backward_bytes_read = 0;
+  stats.backward_bytes_written = 0;
+  for (size_t op = 0; op < GRAD_OP_COUNT; ++op) {
+    size_t count = stats.backward_nodes[op];
+    size_t operands = count * grad__reverse_arity((grad_reverse_op_t)op);
+    if (op == GRAD_OP_BLACKBOX) {
+      operands = stats.backward_blackbox_operands;
+    }
+    size_t values = op == GRAD_OP_ADD || op == GRAD_OP_NEG ? 0 : operands;
+    stats.backward_bytes_read +=
+        count * sizeof(grad_reverse_t) +
+        (operands + values) * sizeof(grad_real_t);
+    stats.backward_bytes_written +=
+        (count + operands) * sizeof(grad_real_t);
+    stats.backward_estimated_seconds[op] =
+        stats.backward_samples[op]
+            ? stats.backward_sampled_seconds[op] / stats.backward_samples[op] *
+                  (double)count
+            : 0;
+  }
+  return stats;
+}
+
+void grad_stats_reset(void) {
+  memset(&grad__stats, 0, sizeof(grad__stats));
+  grad__stats.reverse_peak_id = grad_reverse_current_id;
+  grad__stats.forward_peak_id = grad_forward_current_id;
+  grad__sample_countdown = GRAD_STATS_SAMPLE_PERIOD;
+}
+#endif // GRAD_STATS
+
+// Vector-Jacobian product over the nodes recorded since begin: seeds each
+// output with its weight and sweeps only that part of the tape, leaving
+// adjoints below begin untouched. Can be called repeatedly on one recording.
+static void grad__reverse_vjp(size_t begin, grad_reverse_t *const *outputs,
+                              const grad_real_t *seed, size_t n) {
+  for (size_t i = begin; i < grad_reverse_current_id; ++i) {
+    grad_reverse_tape[i].derivative = (grad_real_t)0.0;
+  }
+  grad__reverse_bound_clean = 0;
+  for (size_t i = 0; i < n; ++i) {
+    outputs[i]->derivative += seed[i];
+  }
+  GRAD__STATS(grad__stats.backward_sweeps += 1);
+  grad__reverse_sweep(begin, grad_reverse_current_id);
+}
+
+static int grad__blackbox_entry_compare(const void *a, const void *b) {
+  size_t x = ((const grad__blackbox_entry_t *)a)->node;
+  size_t y = ((const grad__blackbox_entry_t *)b)->node;
+  return (x > y) - (x < y);
+}
+
+// Moves the black-box side table along with a permutation of the tape.
+static void grad__blackbox_remap(const size_t *new_index) {
+  for (size_t g = 0; g < grad__blackbox_group_count; ++g) {
+    grad__blackbox_group_t *group = grad__blackbox_groups[g];
+    for (size_t j = 0; j < group->box.inputs; ++j) {
+      group->operands[j] =
+          &grad_reverse_tape[new_index[group->operands[j] - grad_reverse_tape]];
+    }
+    for (size_t k = 0; k < group->box.outputs; ++k) {
+      group->results[k] =
+          &grad_reverse_tape[new_index[group->results[k] - grad_reverse_tape]];
+    }
+  }
+  for (size_t e = 0; e < grad__blackbox_entry_count; ++e) {
+    grad__blackbox_entries[e].node = new_index[grad__blackbox_entries[e].node];
+  }
+  qsort(grad__blackbox_entries, grad__blackbox_entry_count,
+        sizeof(grad__blackbox_entry_t), grad__blackbox_entry_compare);
+}
+
+static double grad__reverse_operand_distance(void) {
+  size_t total = 0;
+  size_t count = 0;
+  for (size_t i = 0; i < grad_reverse_current_id; ++i) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    size_t arity = grad__reverse_node_arity(grad);
+    for (size_t k = 0; k < arity; ++k) {
+      total += i - (size_t)(grad__reverse_operand(grad, k) - grad_reverse_tape);
+      count += 1;
+    }
+  }
+  return count ? (double)total / (double)count : 0;
+}
+
+grad_reverse_reorder_t grad_reverse_reorder(grad_reverse_t *const *outputs,
+                                            size_t n_outputs, size_t *remap) {
+  size_t n = grad_reverse_current_id;
+  grad_reverse_reorder_t report = {grad__reverse_operand_distance(), 0};
+
+  size_t edges = 0;
+  for (size_t i = 0; i < n; ++i) {
+    edges += grad__reverse_node_arity(&grad_reverse_tape[i]);
+  }
+  unsigned char *state = calloc(n, 1);
+  size_t *order = malloc(sizeof(size_t) * n);
+  size_t *new_index = malloc(sizeof(size_t) * n);
+  size_t *stack = malloc(sizeof(size_t) * (n + edges + 1));
+  grad_reverse_t *old = malloc(sizeof(grad_reverse_t) * n);
+  assert(state && order && new_index && stack && old);
+
+  // Bound leaf blocks go first and stay contiguous so bindings remain valid.
+  size_t placed = 0;
+  for (size_t b = 0; b < grad__reverse_binding_count; ++b) {
+    grad__reverse_binding_t *binding = &grad__reverse_bindings[b];
+    for (size_t i = 0; i < binding->size; ++i) {
+      state[binding->begin + i] = 2;
+      order[placed++] = binding->begin + i;
+    }
+    binding->begin = placed - binding->size;
+  }
+
+  // Iterative post-order DFS: 0 = unseen, 1 = operands pending, 2 = placed.
+  for (size_t o = 0; o < n_outputs; ++o) {
+    size_t top = 0;
+    stack[top++] = outputs[o] - grad_reverse_tape;
+    while (top > 0) {
+      size_t i = stack[top - 1];
+      const grad_reverse_t *grad = &grad_reverse_tape[i];
+      if (state[i] == 0) {
+        state[i] = 1;
+        for (size_t k = grad__reverse_node_arity(grad); k-- > 0;) {
+          size_t j = grad__reverse_operand(grad, k) - grad_reverse_tape;
+          if (state[j] == 0) {
+            stack[top++] = j;
+          }
+        }
+      } else {
+        top -= 1;
+        if (state[i] == 1) {
+          state[i] = 2;
+          order[placed++] = i;
+        }
+      }
+    }
+  }
+  // Nodes no output depends on keep their relative order at the end; their
+  // operands are either placed above or come earlier among themselves.
+  for (size_t i = 0; i < n; ++i) {
+    if (state[i] != 2) {
+      order[placed++] = i;
+    }
+  }
+
+  for (size_t k = 0; k < n; ++k) {
+    new_index[order[k]] = k;
+  }
+  memcpy(old, grad_reverse_tape, sizeof(grad_reverse_t) * n);
+  for (size_t k = 0; k < n; ++k) {
+    grad_reverse_t *grad = &grad_reverse_tape[k];
+    *grad = old[order[k]];
+    size_t arity = grad__reverse_arity(grad->operation);
+    if (arity > 0) {
+      grad->left =
+          &grad_reverse_tape[new_index[grad->left - grad_reverse_tape]];
+    }
+    if (arity > 1) {
+      grad->right =
+          &grad_reverse_tape[new_index[grad->right - grad_reverse_tape]];
+    }
+  }
+  grad__blackbox_remap(new_index);
+
+#ifdef GRAD_SOURCE_PROFILE
+  uint32_t *source = malloc(sizeof(uint32_t) * n);
+  assert(source);
+  memcpy(source, grad__reverse_source, sizeof(uint32_t) * n);
+  for (size_t k = 0; k < n; ++k) {
+    grad__reverse_source[k] = source[order[k]];
+  }
+  free(source);
+#endif // GRAD_SOURCE_PROFILE
+
+  if (remap != NULL) {
+    memcpy(remap, new_index, sizeof(size_t) * n);
+  }
+  report.distance_after = grad__reverse_operand_distance();
+
+  free(state);
+  free(order);
+  free(new_index);
+  free(stack);
+  free(old);
+  return report;
+}
+
+// Relative cost of recomputing one op, in units of one ADD.
+static size_t grad__reverse_op_cost(grad_reverse_op_t operation) {
+  switch (operation) {
+  case GRAD_OP_ADD:
+  case GRAD_OP_MUL:
+  case GRAD_OP_NEG:
+    return 1;
+  case GRAD_OP_INV:
+    return 4;
+  default:
+    return 16;
+  }
+}
+
+typedef struct grad__remat_candidate_t {
+  size_t node;
+  size_t cost;
+} grad__remat_candidate_t;
+
+static int grad__remat_compare(const void *a, const void *b) {
+  const grad__remat_candidate_t *left = a;
+  const grad__remat_candidate_t *right = b;
+  if (left->cost != right->cost) {
+    return left->cost < right->cost ? -1 : 1;
+  }
+  return left->node < right->node ? -1 : left->node > right->node ? 1 : 0;
+}
+
+// Values read by backward start out stored. A node becomes a candidate for
+// recomputation when all its operands are themselves read by backward (so
+// they stay available either way) and its chain cost stays within
+// GRAD_REMAT_MAX_COST. The chain cost assumes every candidate ancestor is
+// recomputed too, so it bounds the real cost. Candidates are then
+// converted cheapest first (reads x chain cost) until the store fits.
+grad_reverse_remat_t grad_reverse_remat_plan(size_t budget_bytes) {
+  size_t n = grad_reverse_current_id;
+  grad_reverse_remat_t plan = {0};
+  plan.nodes = n;
+  plan.slot = malloc(sizeof(size_t) * n);
+  size_t *reads = calloc(n, sizeof(size_t));
+  size_t *chain = calloc(n, sizeof(size_t));
+  grad__remat_candidate_t *candidates =
+      malloc(sizeof(grad__remat_candidate_t) * (n ? n : 1));
+  assert(plan.slot && reads && chain && candidates);
+
+  for (size_t i = 0; i < n; ++i) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    if (grad->operation == GRAD_OP_MUL) {
+      reads[grad->left - grad_reverse_tape] += 1;
+      reads[grad->right - grad_reverse_tape] += 1;
+    } else if (grad->operation != GRAD_OP_NONE &&
+               grad->operation != GRAD_OP_ADD &&
+               grad->operation != GRAD_OP_NEG &&
+               grad->operation != GRAD_OP_BLACKBOX) {
+      reads[grad->left - grad_reverse_tape] += 1;
+    }
+  }
+
+  size_t count = 0;
+  size_t stored = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    if (reads[i] == 0) {
+      plan.slot[i] = GRAD_REMAT_DEAD;
+      continue;
+    }
+    plan.slot[i] = 0;
+    stored += 1;
+    size_t arity = grad__reverse_arity(grad->operation);
+    if (arity == 0) {
+      continue;
+    }
+    size_t l = grad->left - grad_reverse_tape;
+    size_t r = arity > 1 ? (size_t)(grad->right - grad_reverse_tape) : l;
+    if (reads[l] == 0 || reads[r] == 0) {
+      continue;
+    }
+    chain[i] = grad__reverse_op_cost(grad->operation) + chain[l] +
+               (arity > 1 ? chain[r] : 0);
+    if (chain[i] > GRAD_REMAT_MAX_COST) {
+      chain[i] = 0;
+      continue;
+    }
+    candidates[count].node = i;
+    candidates[count].cost = reads[i] * chain[i];
+    count += 1;
+  }
+
+  qsort(candidates, count, sizeof(grad__remat_candidate_t),
+        grad__remat_compare);
+  for (size_t c = 0;
+       c < count && stored * sizeof(grad_real_t) > budget_bytes; ++c) {
+    plan.slot[candidates[c].node] = GRAD_REMAT_RECOMPUTE;
+    plan.recompute_cost += candidates[c].cost;
+    plan.recomputed += 1;
+    stored -= 1;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (plan.slot[i] != GRAD_REMAT_DEAD &&
+        plan.slot[i] != GRAD_REMAT_RECOMPUTE) {
+      plan.slot[i] = plan.stored++;
+    }
+  }
+  plan.bytes_stored = plan.stored * sizeof(grad_real_t);
+  plan.bytes_saved = n * sizeof(grad_real_t) - plan.bytes_stored;
+
+  free(reads);
+  free(chain);
+  free(candidates);
+  return plan;
+}
+
+void grad_reverse_remat_save(const grad_reverse_remat_t *plan,
+                             grad_real_t *store) {
+  for (size_t i = 0; i < plan->nodes; ++i) {
+    size_t slot = plan->slot[i];
+    if (slot != GRAD_REMAT_DEAD && slot != GRAD_REMAT_RECOMPUTE) {
+      store[slot] = grad_reverse_tape[i].value;
+    }
+  }
+}
+
+void grad_reverse_remat_backward(const grad_reverse_remat_t *plan,
+                                 const grad_real_t *store,
+                                 grad_reverse_t *output) {
+  assert(plan->nodes == grad_reverse_current_id);
+  grad__reverse_backward_begin();
+  grad__reverse_bound_clean = 0;
+  for (size_t i = 0; i < plan->nodes; ++i) {
+    grad_reverse_tape[i].derivative = (grad_real_t)0.0;
+  }
+  output->derivative = 1.0;
+
+  grad__reverse_sweep_values(0, plan->nodes, plan, store);
+  grad__reverse_bindings_store();
+  grad__reverse_backward_end();
+}
+
+void grad_reverse_remat_free(grad_reverse_remat_t *plan) {
+  free(plan->slot);
+  plan->slot = NULL;
+}
+
+static void grad__reverse_replay_node(grad_reverse_t *grad) {
+  if (grad->operation == GRAD_OP_BLACKBOX) {
+    // The earliest output on the tape re-evaluates the whole group.
+    grad__blackbox_group_t *group =
+        grad__blackbox_find((size_t)(grad - grad_reverse_tape))->group;
+    for (size_t k = 0; k < group->box.outputs; ++k) {
+      if (group->results[k] < grad) {
+        return;
+      }
+    }
+    grad__blackbox_evaluate(group);
+    return;
+  }
+  grad_real_t right = grad__reverse_arity(grad->operation) > 1
+                          ? grad->right->value
+                          : (grad_real_t)0.0;
+  grad->value = grad__reverse_apply(grad->operation, grad->left->value, right);
+}
+
+void grad_reverse_replay(void) {
+  GRAD__TRACE(grad_trace_begin("replay"));
+  grad__reverse_bindings_load();
+  for (size_t i = 0; i < grad_reverse_current_id; ++i) {
+    if (grad_reverse_tape[i].operation != GRAD_OP_NONE) {
+      grad__reverse_replay_node(&grad_reverse_tape[i]);
+    }
+  }
+  GRAD__TRACE(grad_trace_end("replay"));
+}
+
+grad_reverse_schedule_t grad_reverse_schedule(void) {
+  size_t n = grad_reverse_current_id;
+  grad_reverse_schedule_t schedule = {0};
+  schedule.nodes = n;
+  size_t *level = calloc(n ? n : 1, sizeof(size_t));
+  assert(level);
+
+  size_t ops = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    size_t arity = grad__reverse_node_arity(grad);
+    if (arity == 0 && grad->operation != GRAD_OP_BLACKBOX) {
+      continue;
+    }
+    size_t l = 0;
+    for (size_t k = 0; k < arity; ++k) {
+      size_t r = level[grad__reverse_operand(grad, k) - grad_reverse_tape];
+      l = r > l ? r : l;
+    }
+    level[i] = l + 1;
+    schedule.levels = l + 1 > schedule.levels ? l + 1 : schedule.levels;
+    ops += 1;
+  }
+
+  schedule.order = malloc(sizeof(size_t) * (ops ? ops : 1));
+  schedule.offset = calloc(schedule.levels + 1, sizeof(size_t));
+  assert(schedule.order && schedule.offset);
+  for (size_t i = 0; i < n; ++i) {
+    if (level[i] != 0) {
+      schedule.offset[level[i]] += 1;
+    }
+  }
+  for (size_t l = 0; l < schedule.levels; ++l) {
+    size_t width = schedule.offset[l + 1];
+    schedule.widest = width > schedule.widest ? width : schedule.widest;
+    schedule.offset[l + 1] += schedule.offset[l];
+  }
+  // Counting sort, keeping tape order within a level.
+  for (size_t i = 0; i < n; ++i) {
+    if (level[i] != 0) {
+      schedule.order[schedule.offset[level[i] - 1]++] = i;
+    }
+  }
+  for (size_t l = schedule.levels; l > 0; --l) {
+    schedule.offset[l] = schedule.offset[l - 1];
+  }
+  schedule.offset[0] = 0;
+
+  free(level);
+  return schedule;
+}
+
+static void grad__reverse_replay_range(size_t begin, size_t end,
+                                       void *user) {
+  const size_t *order = user;
+  for (size_t i = begin; i < end; ++i) {
+    grad__reverse_replay_node(&grad_reverse_tape[order[i]]);
+  }
+}
+
+void grad_reverse_replay_schedule(const grad_reverse_schedule_t *schedule,
+                                  size_t grain) {
+  assert(schedule->nodes == grad_reverse_current_id);
+  grain = grain ? grain : grad_tune_get()->parallel_grain;
+  GRAD__TRACE(grad_trace_begin("replay"));
+  grad__reverse_bindings_load();
+  for (size_t l = 0; l < schedule->levels; ++l) {
+    size_t begin = schedule->offset[l];
+    grad_parallel_for(schedule->offset[l + 1] - begin, grain,
+                      grad__reverse_replay_range, schedule->order + begin);
+  }
+  GRAD__TRACE(grad_trace_end("replay"));
+}
+
+void grad_reverse_schedule_free(grad_reverse_schedule_t *schedule) {
+  free(schedule->order);
+  free(schedule->offset);
+  schedule->order = NULL;
+  schedule->offset = NULL;
+}
+
+static size_t grad__online_cpus(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  return online > 0 ? (size_t)online : 1;
+#else
+  return 1;
+#endif
+}
+
+grad_tune_t grad__tune = {0};
+
+#ifdef GRAD_TUNE
+#include <stdio.h>
+
+// Kernels are timed on private buffers so tuning never disturbs a tape.
+#define GRAD__TUNE_NODES 4096
+
+static double grad__tune_seconds(void) {
+  return (double)grad__now_ns() * 1e-9;
+}
+
+// Seconds per direction of the forward replay stream at `lanes` wide.
+static double grad__tune_forward(grad__forward_entry_t *entries,
+                                 grad_real_t (*t)[GRAD_FORWARD_REPLAY_LANES],
+                                 size_t lanes) {
+  double best = 1e30;
+  for (int repeat = 0; repeat < 5; ++repeat) {
+    double start = grad__tune_seconds();
+    for (size_t first = 0; first < GRAD_FORWARD_REPLAY_LANES * 8;
+         first += lanes) {
+      grad__forward_stream(entries, GRAD__TUNE_NODES - 64, t, lanes);
+    }
+    double elapsed = grad__tune_seconds() - start;
+    best = elapsed < best ? elapsed : best;
+  }
+  return best / (GRAD_FORWARD_REPLAY_LANES * 8);
+}
+
+// Seconds per direction of the MUL case of the second-order sweep, the
+// inner loop that dominates grad__reverse_hvp_sweep.
+static double grad__tune_hvp(const grad__forward_entry_t *entries,
+                             grad_real_t (*dot)[GRAD_HVP_LANES],
+                             grad_real_t (*adot)[GRAD_HVP_LANES],
+                             size_t lanes) {
+  double best = 1e30;
+  for (int repeat = 0; repeat < 5; ++repeat) {
+    double start = grad__tune_seconds();
+    for (size_t first = 0; first < GRAD_HVP_LANES * 8; first += lanes) {
+      for (size_t e = 0; e < GRAD__TUNE_NODES - 64; ++e) {
+        const grad__forward_entry_t *entry = &entries[e];
+        grad_real_t lv = entry->left_partial;
+        grad_real_t rv = entry->right_partial;
+        for (size_t k = 0; k < lanes; ++k) {
+          dot[entry->result][k] =
+              dot[entry->left][k] * rv + lv * dot[entry->right][k];
+        }
+        for (size_t k = 0; k < lanes; ++k) {
+          adot[entry->left][k] +=
+              dot[entry->right][k] + rv * adot[entry->result][k];
+          adot[entry->right][k] +=
+              dot[entry->left][k] + lv * adot[entry->result][k];
+        }
+      }
+    }
+    double elapsed = grad__tune_seconds() - start;
+    best = elapsed < best ? elapsed : best;
+  }
+  return best / (GRAD_HVP_LANES * 8);
+}
+
+static size_t grad__tune_lanes(double (*cost)(size_t lanes, void *context),
+                               void *context, size_t max) {
+  size_t best = max;
+  double best_cost = cost(max, context);
+  for (size_t lanes = 1; lanes < max; lanes *= 2) {
+    double c = cost(lanes, context);
+    // Prefer wider batches unless narrower ones are clearly faster.
+    if (c < best_cost * 0.95) {
+      best = lanes;
+      best_cost = c;
+    }
+  }
+  return best;
+}
+
+typedef struct grad__tune_buffers_t {
+  grad__forward_entry_t *entries;
+  grad_real_t (*a)[GRAD_FORWARD_REPLAY_LANES];
+  grad_real_t (*b)[GRAD_HVP_LANES];
+  grad_real_t (*c)[GRAD_HVP_LANES];
+} grad__tune_buffers_t;
+
+static double grad__tune_forward_cost(size_t lanes, void *context) {
+  grad__tune_buffers_t *buffers = context;
+  return grad__tune_forward(buffers->entries, buffers->a, lanes);
+}
+
+static double grad__tune_hvp_cost(size_t lanes, void *context) {
+  grad__tune_buffers_t *buffers = context;
+  return grad__tune_hvp(buffers->entries, buffers->b, buffers->c, lanes);
+}
+
+// Seconds per op of grad_reverse_replay on a private random graph.
+static double grad__tune_replay(grad__forward_entry_t *entries) {
+  grad_reverse_t *nodes = malloc(sizeof(grad_reverse_t) * GRAD__TUNE_NODES);
+  assert(nodes);
+  for (size_t i = 0; i < GRAD__TUNE_NODES; ++i) {
+    nodes[i].value = (grad_real_t)(1.0 + (double)(i % 7) * 0.125);
+    nodes[i].operation = GRAD_OP_NONE;
+    if (i >= 64) {
+      nodes[i].operation = (grad_reverse_op_t)(1 + i % GRAD_OP_LOG);
+      nodes[i].left = &nodes[entries[i - 64].left];
+      nodes[i].right = &nodes[entries[i - 64].right];
+    }
+  }
+  double best = 1e30;
+  for (int repeat = 0; repeat < 5; ++repeat) {
+    double start = grad__tune_seconds();
+    for (size_t i = 64; i < GRAD__TUNE_NODES; ++i) {
+      grad__reverse_replay_node(&nodes[i]);
+    }
+    double elapsed = grad__tune_seconds() - start;
+    best = elapsed < best ? elapsed : best;
+  }
+  free(nodes);
+  return best / (GRAD__TUNE_NODES - 64);
+}
+
+#ifdef GRAD_THREADS
+static void grad__tune_replay_range(size_t begin, size_t end, void *user) {
+  grad_reverse_t *nodes = user;
+  for (size_t i = begin; i < end; ++i) {
+    grad__reverse_replay_node(&nodes[64 + i]);
+  }
+}
+
+// Pool size with the fastest parallel replay of one wide level, trying
+// powers of two up to the online CPUs. Larger pools must win clearly.
+static size_t grad__tune_threads(size_t grain) {
+  size_t cpus = grad__online_cpus();
+  cpus = cpus < GRAD_THREADS_MAX ? cpus : GRAD_THREADS_MAX;
+  if (grad__pool.threads > 1) {
+    return cpus;
+  }
+  size_t width = 16 * grain;
+  grad_reverse_t *nodes = malloc(sizeof(grad_reverse_t) * (64 + width));
+  assert(nodes);
+  for (size_t i = 0; i < 64 + width; ++i) {
+    nodes[i].value = (grad_real_t)(1.0 + (double)(i % 7) * 0.125);
+    nodes[i].operation = GRAD_OP_NONE;
+    if (i >= 64) {
+      nodes[i].operation = (grad_reverse_op_t)(1 + i % GRAD_OP_LOG);
+      nodes[i].left = &nodes[i % 64];
+      nodes[i].right = &nodes[(i / 64) % 64];
+    }
+  }
+  size_t best = 1;
+  double best_seconds = 1e30;
+  for (size_t threads = 1; threads <= cpus; threads *= 2) {
+    if (threads > 1) {
+      grad_threads_start(threads);
+    }
+    double seconds = 1e30;
+    for (int repeat = 0; repeat < 5; ++repeat) {
+      double start = grad__tune_seconds();
+      grad_parallel_for(width, grain, grad__tune_replay_range, nodes);
+      double elapsed = grad__tune_seconds() - start;
+      seconds = elapsed < seconds ? elapsed : seconds;
+    }
+    if (threads > 1) {
+      grad_threads_stop();
+    }
+    if (seconds < best_seconds * 0.9) {
+      best = threads;
+      best_seconds = seconds;
+    }
+  }
+  free(nodes);
+  return best;
+}
+#endif // GRAD_THREADS
+
+const grad_tune_t *grad_tune_run(void) {
+  grad__tune_buffers_t buffers;
+  buffers.entries =
+      malloc(sizeof(grad__forward_entry_t) * GRAD__TUNE_NODES);
+  buffers.a = calloc(GRAD__TUNE_NODES, sizeof(*buffers.a));
+  buffers.b = calloc(GRAD__TUNE_NODES, sizeof(*buffers.b));
+  buffers.c = calloc(GRAD__TUNE_NODES, sizeof(*buffers.c));
+  assert(buffers.entries && buffers.a && buffers.b && buffers.c);
+  uint64_t state = 1;
+  for (size_t e = 0; e + 64 < GRAD__TUNE_NODES; ++e) {
+    grad__forward_entry_t *entry = &buffers.entries[e];
+    entry->result = e + 64;
+    entry->left = grad__random_next(&state) % (e + 64);
+    entry->right = grad__random_next(&state) % (e + 64);
+    entry->left_partial = (grad_real_t)0.5;
+    entry->right_partial = (grad_real_t)0.25;
+  }
+
+  grad__tune.forward_lanes = grad__tune_lanes(
+      grad__tune_forward_cost, &buffers, GRAD_FORWARD_REPLAY_LANES);
+  grad__tune.hvp_lanes =
+      grad__tune_lanes(grad__tune_hvp_cost, &buffers, GRAD_HVP_LANES);
+  grad__tune.op_seconds = grad__tune_replay(buffers.entries);
+  // A task should take ~20us, enough to hide waking a pool worker.
+  double grain = 20e-6 / (grad__tune.op_seconds > 0 ? grad__tune.op_seconds
+                                                    : 1e-9);
+  grad__tune.parallel_grain = grain < 64 ? 64 : (size_t)grain;
+#ifdef GRAD_THREADS
+  grad__tune.threads = grad__tune_threads(grad__tune.parallel_grain);
+#else
+  grad__tune.threads = grad__online_cpus();
+#endif // GRAD_THREADS
+  grad__tune.loaded = 0;
+
+  free(buffers.entries);
+  free(buffers.a);
+  free(buffers.b);
+  free(buffers.c);
+
+  FILE *file = fopen(GRAD_TUNE_FILE, "w");
+  if (file != NULL) {
+    fprintf(file, "grad_tune 1 %zu %d %d\n", sizeof(grad_real_t),
+            GRAD_FORWARD_REPLAY_LANES, GRAD_HVP_LANES);
+    fprintf(file, "forward_lanes %zu\nhvp_lanes %zu\nparallel_grain %zu\n",
+            grad__tune.forward_lanes, grad__tune.hvp_lanes,
+            grad__tune.parallel_grain);
+    fprintf(file, "threads %zu\nop_seconds %.9e\n", grad__tune.threads,
+            grad__tune.op_seconds);
+    fclose(file);
+  }
+  return &grad__tune;
+}
+
+// Reads a profile written for the same precision and lane limits.
+static int grad__tune_load(void) {
+  FILE *file = fopen(GRAD_TUNE_FILE, "r");
+  if (file == NULL) {
+    return 0;
+  }
+  size_t real_size = 0;
+  int forward_max = 0;
+  int hvp_max = 0;
+  grad_tune_t tune = {0};
+  int ok = fscanf(file, "grad_tune 1 %zu %d %d", &real_size, &forward_max,
+                  &hvp_max) == 3 &&
+           fscanf(file, " forward_lanes %zu hvp_lanes %zu parallel_grain %zu",
+                  &tune.forward_lanes, &tune.hvp_lanes,
+                  &tune.parallel_grain) == 3 &&
+           fscanf(file, " threads %zu op_seconds %lf", &tune.threads,
+                  &tune.op_seconds) == 2;
+  fclose(file);
+  ok = ok && real_size == sizeof(grad_real_t) &&
+       forward_max == GRAD_FORWARD_REPLAY_LANES &&
+       hvp_max == GRAD_HVP_LANES && tune.forward_lanes >= 1 &&
+       tune.forward_lanes <= GRAD_FORWARD_REPLAY_LANES &&
+       tune.hvp_lanes >= 1 && tune.hvp_lanes <= GRAD_HVP_LANES &&
+       tune.parallel_grain >= 1 && tune.threads >= 1;
+  if (ok) {
+    tune.loaded = 1;
+    grad__tune = tune;
+  }
+  return ok;
+}
+#endif // GRAD_TUNE
+
+const grad_tune_t *grad_tune_get(void) {
+  if (grad__tune.forward_lanes == 0) {
+#ifdef GRAD_TUNE
+    if (!grad__tune_load()) {
+      grad_tune_run();
+    }
+#else
+    grad__tune.forward_lanes = GRAD_FORWARD_REPLAY_LANES;
+    grad__tune.hvp_lanes = GRAD_HVP_LANES;
+    grad__tune.parallel_grain = GRAD_PARALLEL_GRAIN;
+    grad__tune.threads = grad__online_cpus();
+#endif // GRAD_TUNE
+  }
+  return &grad__tune;
+}
+
+// Forward-over-reverse second-order sweep. Tangents (dot) are pushed forward
+// through the tape from seeded leaves, then the reverse sweep propagates both
+// the adjoint and its tangent. The adjoint tangent of an input is (H v).
+grad_real_t grad__reverse_dot[GRAD_REVERSE_TAPE_SIZE][GRAD_HVP_LANES];
+grad_real_t grad__reverse_adjoint_dot[GRAD_REVERSE_TAPE_SIZE][GRAD_HVP_LANES];
+
+static void grad__reverse_hvp_clear(size_t lanes) {
+  for (size_t i = 0; i < grad_reverse_current_id; ++i) {
+    if (grad_reverse_tape[i].operation == GRAD_OP_NONE) {
+      memset(grad__reverse_dot[i], 0, sizeof(grad_real_t) * lanes);
+    }
+  }
+}
+
+// First and second derivative of a unary op at its operand.
+static void grad__reverse_unary_partials(const grad_reverse_t *grad,
+                                         grad_real_t *d1, grad_real_t *d2) {
+  grad_real_t a = grad->left->value;
+  switch (grad->operation) {
+  case GRAD_OP_NEG:
+    *d1 = -1;
+    *d2 = 0;
+    break;
+  case GRAD_OP_INV:
+    *d1 = -1 / (a * a);
+    *d2 = 2 / (a * a * a);
+    break;
+  case GRAD_OP_SIN:
+    *d1 = GRAD_COS(a);
+    *d2 = -GRAD_SIN(a);
+    break;
+  case GRAD_OP_COS:
+    *d1 = -GRAD_SIN(a);
+    *d2 = -GRAD_COS(a);
+    break;
+  case GRAD_OP_EXP:
+    *d1 = grad->value;
+    *d2 = grad->value;
+    break;
+  case GRAD_OP_LOG:
+    *d1 = 1 / a;
+    *d2 = -1 / (a * a);
+    break;
+  default:
+    *d1 = 0;
+    *d2 = 0;
+    break;
+  }
+}
+
+static void grad__reverse_hvp_sweep(grad_reverse_t *output, size_t lanes) {
+  size_t end = grad_reverse_current_id;
+  grad__reverse_bound_clean = 0;
+
+  for (size_t i = 0; i < end; ++i) {
+    grad_reverse_t *grad = &grad_reverse_tape[i];
+    grad_real_t *dot = grad__reverse_dot[i];
+    grad->derivative = (grad_real_t)0.0;
+    memset(grad__reverse_adjoint_dot[i], 0, sizeof(grad_real_t) * lanes);
+    if (grad->operation == GRAD_OP_NONE) {
+      continue;
+    }
+    if (grad->operation == GRAD_OP_BLACKBOX) {
+      const grad__blackbox_entry_t *entry = grad__blackbox_find(i);
+      const grad__blackbox_group_t *group = entry->group;
+      size_t n = group->box.inputs;
+      const grad_real_t *row = &group->jacobian[entry->output * n];
+      memset(dot, 0, sizeof(grad_real_t) * lanes);
+      for (size_t j = 0; j < n; ++j) {
+        const grad_real_t *o =
+            grad__reverse_dot[group->operands[j] - grad_reverse_tape];
+        for (size_t k = 0; k < lanes; ++k) {
+          dot[k] += row[j] * o[k];
+        }
+      }
+      continue;
+    }
+
+    const grad_real_t *l = grad__reverse_dot[grad->left - grad_reverse_tape];
+    if (grad->operation == GRAD_OP_ADD || grad->operation == GRAD_OP_MUL) {
+      const grad_real_t *r =
+          grad__reverse_dot[grad->right - grad_reverse_tape];
+      grad_real_t lv = grad->left->value;
+      grad_real_t rv = grad->right->value;
+      for (size_t k = 0; k < lanes; ++k) {
+        dot[k] = grad->operation == GRAD_OP_ADD ? l[k] + r[k]
+                                                : l[k] * rv + lv * r[k];
+      }
+    } else {
+      grad_real_t d1, d2;
+      grad__reverse_unary_partials(grad, &d1, &d2);
+      for (size_t k = 0; k < lanes; ++k) {
+        dot[k] = d1 * l[k];
+      }
+    }
+  }
+
+  output->derivative = 1.0;
+
+  for (size_t i = end; i-- > 0;) {
+    grad_reverse_t *grad = &grad_reverse_tape[i];
+    if (grad->operation == GRAD_OP_NONE) {
+      continue;
+    }
+    const grad_real_t *adot = grad__reverse_adjoint_dot[i];
+    if (grad->operation == GRAD_OP_BLACKBOX) {
+      // Second derivatives of the black box are taken as zero.
+      const grad__blackbox_entry_t *entry = grad__blackbox_find(i);
+      const grad__blackbox_group_t *group = entry->group;
+      size_t n = group->box.inputs;
+      const grad_real_t *row = &group->jacobian[entry->output * n];
+      for (size_t j = 0; j < n; ++j) {
+        grad_reverse_t *operand = group->operands[j];
+        grad_real_t *o_adot =
+            grad__reverse_adjoint_dot[operand - grad_reverse_tape];
+        operand->derivative += row[j] * grad->derivative;
+        for (size_t k = 0; k < lanes; ++k) {
+          o_adot[k] += row[j] * adot[k];
+        }
+      }
+      continue;
+    }
+    size_t li = grad->left - grad_reverse_tape;
+    grad_real_t *l_adot = grad__reverse_adjoint_dot[li];
+
+    if (grad->operation == GRAD_OP_ADD) {
+      grad_real_t *r_adot =
+          grad__reverse_adjoint_dot[grad->right - grad_reverse_tape];
+      grad->left->derivative += grad->derivative;
+      grad->right->derivative += grad->derivative;
+      for (size_t k = 0; k < lanes; ++k) {
+        l_adot[k] += adot[k];
+        r_adot[k] += adot[k];
+      }
+    } else if (grad->operation == GRAD_OP_MUL) {
+      size_t ri = grad->right - grad_reverse_tape;
+      grad_real_t *r_adot = grad__reverse_adjoint_dot[ri];
+      const grad_real_t *l_dot = grad__reverse_dot[li];
+      const grad_real_t *r_dot = grad__reverse_dot[ri];
+      grad_real_t lv = grad->left->value;
+      grad_real_t rv = grad->right->value;
+      grad_real_t d = grad->derivative;
+      grad->left->derivative += rv * d;
+      grad->right->derivative += lv * d;
+      for (size_t k = 0; k < lanes; ++k) {
+        l_adot[k] += r_dot[k] * d + rv * adot[k];
+        r_adot[k] += l_dot[k] * d + lv * adot[k];
+      }
+    } else {
+      const grad_real_t *l_dot = grad__reverse_dot[li];
+      grad_real_t d1, d2;
+      grad__reverse_unary_partials(grad, &d1, &d2);
+      grad_real_t d = grad->derivative;
+      grad->left->derivative += d1 * d;
+      for (size_t k = 0; k < lanes; ++k) {
+        l_adot[k] += d2 * l_dot[k] * d + d1 * adot[k];
+      }
+    }
+  }
+}
+
+void grad_reverse_hvp(grad_reverse_t *output, grad_reverse_t *const *inputs,
+                      size_t n, const grad_real_t *v, grad_real_t *hv,
+                      size_t lanes) {
+  assert(lanes <= GRAD_HVP_LANES);
+  grad__reverse_hvp_clear(lanes);
+  for (size_t i = 0; i < n; ++i) {
+    memcpy(grad__reverse_dot[inputs[i] - grad_reverse_tape], v + i * lanes,
+           sizeof(grad_real_t) * lanes);
+  }
+  grad__reverse_hvp_sweep(output, lanes);
+  for (size_t i = 0; i < n; ++i) {
+    memcpy(hv + i * lanes,
+           grad__reverse_adjoint_dot[inputs[i] - grad_reverse_tape],
+           sizeof(grad_real_t) * lanes);
+  }
+}
+
+void grad_reverse_hutchinson(grad_reverse_t *output,
+                             grad_reverse_t *const *inputs, size_t n,
+                             size_t probes, unsigned long long seed,
+                             grad_real_t *diag, grad_real_t *diag_variance,
+                             grad_hutchinson_t *trace) {
+  uint64_t state = seed;
+  double trace_mean = 0;
+  double trace_m2 = 0;
+  size_t count = 0;
+
+  // diag holds the running mean and diag_variance the running sum of squared
+  // deviations (Welford) until the final scaling below.
+  for (size_t i = 0; diag && i < n; ++i) {
+    diag[i] = 0;
+  }
+  for (size_t i = 0; diag_variance && i < n; ++i) {
+    diag_variance[i] = 0;
+  }
+
+  size_t width = grad_tune_get()->hvp_lanes;
+  while (count < probes) {
+    size_t lanes = probes - count < width ? probes - count : width;
+    grad__reverse_hvp_clear(lanes);
+    for (size_t i = 0; i < n; ++i) {
+      grad_real_t *dot = grad__reverse_dot[inputs[i] - grad_reverse_tape];
+      uint64_t bits = 0;
+      for (size_t k = 0; k < lanes; ++k) {
+        if (k % 64 == 0) {
+          bits = grad__random_next(&state);
+        }
+        dot[k] = (bits >> k % 64) & 1 ? (grad_real_t)1.0 : (grad_real_t)-1.0;
+      }
+    }
+    grad__reverse_hvp_sweep(output, lanes);
+
+    for (size_t k = 0; k < lanes; ++k) {
+      double sample = 0;
+      size_t seen = count + k + 1;
+      for (size_t i = 0; i < n; ++i) {
+        size_t index = inputs[i] - grad_reverse_tape;
+        grad_real_t d =
+            grad__reverse_dot[index][k] * grad__reverse_adjoint_dot[index][k];
+        sample += d;
+        if (diag) {
+          grad_real_t delta = d - diag[i];
+          diag[i] += delta / seen;
+          if (diag_variance) {
+            diag_variance[i] += delta * (d - diag[i]);
+          }
+        }
+      }
+      double delta = sample - trace_mean;
+      trace_mean += delta / seen;
+      trace_m2 += delta * (sample - trace_mean);
+    }
+    count += lanes;
+  }
+
+  for (size_t i = 0; diag_variance && i < n; ++i) {
+    diag_variance[i] =
+        count > 1 ? diag_variance[i] / ((count - 1) * count) : 0;
+  }
+  if (trace) {
+    trace->trace = (grad_real_t)trace_mean;
+    trace->trace_variance =
+        count > 1 ? (grad_real_t)(trace_m2 / ((count - 1) * count)) : 0;
+    trace->probes = count;
+  }
+}
+
+static int grad__pair_compare(const void *a, const void *b) {
+  const size_t *left = a;
+  const size_t *right = b;
+  if (left[0] != right[0]) {
+    return left[0] < right[0] ? -1 : 1;
+  }
+  return left[1] < right[1] ? -1 : left[1] > right[1] ? 1 : 0;
+}
+
+// Sorts count (i, j) pairs and drops duplicates; returns the new count.
+static size_t grad__pairs_unique(size_t *pairs, size_t count) {
+  qsort(pairs, count, 2 * sizeof(size_t), grad__pair_compare);
+  size_t unique = 0;
+  for (size_t k = 0; k < count; ++k) {
+    if (unique == 0 || pairs[2 * k] != pairs[2 * unique - 2] ||
+        pairs[2 * k + 1] != pairs[2 * unique - 1]) {
+      pairs[2 * unique] = pairs[2 * k];
+      pairs[2 * unique + 1] = pairs[2 * k + 1];
+      unique += 1;
+    }
+  }
+  return unique;
+}
+
+// Greedy star colouring (Gebremedhin, Manne and Pothen 2005, Algorithm 4.1):
+// a distance-1 colouring in which every path on four vertices uses at least
+// three colours, so each entry can be read directly from one compressed row.
+static void grad__star_colour(grad_sparse_hessian_t *hessian) {
+  size_t n = hessian->n;
+  const size_t *row = hessian->row;
+  const size_t *col = hessian->col;
+  size_t *colour = hessian->colour;
+  // forbidden[c] == v + 1 marks colour c as unavailable for vertex v.
+  size_t *forbidden = calloc(n + 1, sizeof(size_t));
+  assert(forbidden);
+  for (size_t v = 0; v < n; ++v) {
+    colour[v] = 0;
+  }
+  hessian->colours = 0;
+
+  for (size_t v = 0; v < n; ++v) {
+    for (size_t a = row[v]; a < row[v + 1]; ++a) {
+      size_t w = col[a];
+      if (w == v) {
+        continue;
+      }
+      if (colour[w] != 0) {
+        forbidden[colour[w]] = v + 1;
+      }
+      for (size_t b = row[w]; b < row[w + 1]; ++b) {
+        size_t x = col[b];
+        if (x == w || x == v || colour[x] == 0) {
+          continue;
+        }
+        if (colour[w] == 0) {
+          forbidden[colour[x]] = v + 1;
+          continue;
+        }
+        for (size_t c = row[x]; c < row[x + 1]; ++c) {
+          size_t y = col[c];
+          if (y != x && y != w && colour[y] == colour[w]) {
+            forbidden[colour[x]] = v + 1;
+            break;
+          }
+        }
+      }
+    }
+    size_t c = 1;
+    while (forbidden[c] == v + 1) {
+      c += 1;
+    }
+    colour[v] = c;
+    hessian->colours = c > hessian->colours ? c : hessian->colours;
+  }
+  for (size_t v = 0; v < n; ++v) {
+    colour[v] -= 1;
+  }
+  free(forbidden);
+}
+
+// Builds the CSR pattern from count (i, j) pairs, adding the transpose and
+// the diagonal. pairs must have room for 2 * (2 * count + n) entries.
+static grad_sparse_hessian_t grad__sparse_hessian_build(size_t n,
+                                                        size_t *pairs,
+                                                        size_t count) {
+  grad_sparse_hessian_t hessian = {0};
+  hessian.n = n;
+  for (size_t k = 0; k < count; ++k) {
+    pairs[2 * (count + k)] = pairs[2 * k + 1];
+    pairs[2 * (count + k) + 1] = pairs[2 * k];
+  }
+  count *= 2;
+  for (size_t i = 0; i < n; ++i) {
+    pairs[2 * count] = i;
+    pairs[2 * count + 1] = i;
+    count += 1;
+  }
+  count = grad__pairs_unique(pairs, count);
+
+  hessian.row = calloc(n + 1, sizeof(size_t));
+  hessian.col = malloc(sizeof(size_t) * count);
+  hessian.colour = malloc(sizeof(size_t) * (n ? n : 1));
+  assert(hessian.row && hessian.col && hessian.colour);
+  for (size_t k = 0; k < count; ++k) {
+    assert(pairs[2 * k] < n && pairs[2 * k + 1] < n);
+    hessian.col[hessian.nnz++] = pairs[2 * k + 1];
+    hessian.row[pairs[2 * k] + 1] += 1;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    hessian.row[i + 1] += hessian.row[i];
+  }
+  hessian.value = calloc(hessian.nnz ? hessian.nnz : 1, sizeof(grad_real_t));
+  assert(hessian.value);
+  grad__star_colour(&hessian);
+  return hessian;
 }
 
-grad_reverse_t *grad_reverse_neg(grad_reverse_t *grad) {
-  grad_reverse_t *result = grad_reverse_init(-grad->value);
-  result->operation = GRAD_OP_NEG;
-  result->left = grad;
-  return result;
+grad_sparse_hessian_t grad_sparse_hessian_pattern(size_t n, const size_t *row,
+                                                  const size_t *col) {
+  size_t count = row[n];
+  size_t *pairs = malloc(sizeof(size_t) * 2 * (2 * count + n));
+  assert(pairs);
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t k = row[i]; k < row[i + 1]; ++k) {
+      pairs[2 * k] = i;
+      pairs[2 * k + 1] = col[k];
+    }
+  }
+  grad_sparse_hessian_t hessian =
+      grad__sparse_hessian_build(n, pairs, count);
+  free(pairs);
+  return hessian;
 }
 
-grad_reverse_t *grad_reverse_inv(grad_reverse_t *grad) {
-  grad_reverse_t *result = grad_reverse_init(1.0 / grad->value);
-  result->operation = GRAD_OP_INV;
-  result->left = grad;
-  return result;
+typedef struct grad__index_set_t {
+  size_t *index;
+  size_t size;
+} grad__index_set_t;
+
+static grad__index_set_t grad__index_set_union(grad__index_set_t a,
+                                               grad__index_set_t b) {
+  grad__index_set_t set = {malloc(sizeof(size_t) * (a.size + b.size + 1)),
+                           0};
+  assert(set.index);
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a.size || j < b.size) {
+    size_t next = j == b.size || (i < a.size && a.index[i] < b.index[j])
+                      ? a.index[i]
+                      : b.index[j];
+    i += i < a.size && a.index[i] == next;
+    j += j < b.size && b.index[j] == next;
+    set.index[set.size++] = next;
+  }
+  return set;
 }
 
-grad_reverse_t *grad_reverse_sub(grad_reverse_t *left, grad_reverse_t *right) {
-  grad_reverse_t *neg_right = grad_reverse_neg(right);
-  return grad_reverse_add(left, neg_right);
+// Index-domain propagation: each node carries the sorted set of inputs it
+// depends on. A live MUL couples its operands' sets and a live nonlinear
+// unary op couples its operand's set with itself. Black boxes are linear to
+// the second-order sweeps, so they only merge their operands' sets.
+grad_sparse_hessian_t grad_reverse_hessian_pattern(
+    grad_reverse_t *output, grad_reverse_t *const *inputs, size_t n) {
+  size_t end = grad_reverse_current_id;
+  grad__index_set_t *sets = calloc(end, sizeof(grad__index_set_t));
+  unsigned char *live = calloc(end, 1);
+  assert(sets && live);
+
+  live[output - grad_reverse_tape] = 1;
+  for (size_t i = end; i-- > 0;) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    size_t arity = live[i] ? grad__reverse_node_arity(grad) : 0;
+    for (size_t k = 0; k < arity; ++k) {
+      live[grad__reverse_operand(grad, k) - grad_reverse_tape] = 1;
+    }
+  }
+  for (size_t k = 0; k < n; ++k) {
+    size_t i = inputs[k] - grad_reverse_tape;
+    assert(grad_reverse_tape[i].operation == GRAD_OP_NONE);
+    free(sets[i].index);
+    sets[i].index = malloc(sizeof(size_t));
+    assert(sets[i].index);
+    sets[i].index[0] = k;
+    sets[i].size = 1;
+  }
+
+  size_t count = 0;
+  size_t capacity = 64;
+  size_t *pairs = malloc(sizeof(size_t) * 2 * capacity);
+  assert(pairs);
+  for (size_t i = 0; i < end; ++i) {
+    const grad_reverse_t *grad = &grad_reverse_tape[i];
+    if (!live[i] || grad->operation == GRAD_OP_NONE) {
+      continue;
+    }
+    if (grad->operation == GRAD_OP_BLACKBOX) {
+      size_t arity = grad__reverse_node_arity(grad);
+      for (size_t k = 0; k < arity; ++k) {
+        grad__index_set_t merged = grad__index_set_union(
+            sets[i], sets[grad__reverse_operand(grad, k) - grad_reverse_tape]);
+        free(sets[i].index);
+        sets[i] = merged;
+      }
+      continue;
+    }
+    grad__index_set_t left = sets[grad->left - grad_reverse_tape];
+    grad__index_set_t right = {NULL, 0};
+    if (grad__reverse_arity(grad->operation) > 1) {
+      right = sets[grad->right - grad_reverse_tape];
+    }
+    sets[i] = grad__index_set_union(left, right);
+
+    grad__index_set_t a = left;
+    grad__index_set_t b = left;
+    if (grad->operation == GRAD_OP_MUL) {
+      b = right;
+    } else if (grad->operation == GRAD_OP_ADD ||
+               grad->operation == GRAD_OP_NEG) {
+      continue;
+    }
+    for (size_t p = 0; p < a.size; ++p) {
+      for (size_t q = 0; q < b.size; ++q) {
+        if (count == capacity) {
+          count = grad__pairs_unique(pairs, count);
+          if (count > capacity / 2) {
+            capacity *= 2;
+            pairs = realloc(pairs, sizeof(size_t) * 2 * capacity);
+            assert(pairs);
+          }
+        }
+        pairs[2 * count] = a.index[p];
+        pairs[2 * count + 1] = b.index[q];
+        count += 1;
+      }
+    }
+  }
+
+  pairs = realloc(pairs, sizeof(size_t) * 2 * (2 * count + n + 1));
+  assert(pairs);
+  grad_sparse_hessian_t hessian =
+      grad__sparse_hessian_build(n, pairs, count);
+  for (size_t i = 0; i < end; ++i) {
+    free(sets[i].index);
+  }
+  free(sets);
+  free(live);
+  free(pairs);
+  return hessian;
 }
 
-grad_reverse_t *grad_reverse_div(grad_reverse_t *left, grad_reverse_t *right) {
-  grad_reverse_t *inv_right = grad_reverse_inv(right);
-  return grad_reverse_mul(left, inv_right);
+// Column j of colour c contributes H[i][j] to compressed entry (i, c). The
+// star property guarantees that for each off-diagonal (i, j) either j is the
+// only neighbour of i with its colour, or i the only neighbour of j with
+// its, so every entry is read directly without solving.
+void grad_reverse_sparse_hessian(grad_reverse_t *output,
+                                 grad_reverse_t *const *inputs,
+                                 grad_sparse_hessian_t *hessian) {
+  size_t n = hessian->n;
+  size_t colours = hessian->colours;
+  grad_real_t *compressed = malloc(sizeof(grad_real_t) * (n * colours + 1));
+  size_t *seen = calloc(n * colours + 1, sizeof(size_t));
+  assert(compressed && seen);
+
+  size_t width = grad_tune_get()->hvp_lanes;
+  for (size_t first = 0; first < colours; first += width) {
+    size_t lanes = colours - first < width ? colours - first : width;
+    grad__reverse_hvp_clear(lanes);
+    for (size_t i = 0; i < n; ++i) {
+      grad_real_t *dot = grad__reverse_dot[inputs[i] - grad_reverse_tape];
+      for (size_t k = 0; k < lanes; ++k) {
+        dot[k] = hessian->colour[i] == first + k ? 1 : 0;
+      }
+    }
+    grad__reverse_hvp_sweep(output, lanes);
+    for (size_t i = 0; i < n; ++i) {
+      const grad_real_t *adot =
+          grad__reverse_adjoint_dot[inputs[i] - grad_reverse_tape];
+      for (size_t k = 0; k < lanes; ++k) {
+        compressed[i * colours + first + k] = adot[k];
+      }
+    }
+  }
+
+  // seen[i * colours + c] counts the neighbours of i (itself included)
+  // with colour c.
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t k = hessian->row[i]; k < hessian->row[i + 1]; ++k) {
+      seen[i * colours + hessian->colour[hessian->col[k]]] += 1;
+    }
+  }
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t k = hessian->row[i]; k < hessian->row[i + 1]; ++k) {
+      size_t j = hessian->col[k];
+      size_t cj = hessian->colour[j];
+      if (seen[i * colours + cj] == 1) {
+        hessian->value[k] = compressed[i * colours + cj];
+      } else {
+        hessian->value[k] = compressed[j * colours + hessian->colour[i]];
+      }
+    }
+  }
+  free(compressed);
+  free(seen);
 }
 
-grad_reverse_t *grad_reverse_sin(grad_reverse_t *grad) {
-  grad_reverse_t *result = grad_reverse_init(GRAD_SIN(grad->value));
-  result->operation = GRAD_OP_SIN;
-  result->left = grad;
-  return result;
+void grad_sparse_hessian_free(grad_sparse_hessian_t *hessian) {
+  free(hessian->row);
+  free(hessian->col);
+  free(hessian->value);
+  free(hessian->colour);
+  hessian->row = NULL;
+  hessian->col = NULL;
+  hessian->value = NULL;
+  hessian->colour = NULL;
 }
 
-grad_reverse_t *grad_reverse_cos(grad_reverse_t *grad) {
-  grad_reverse_t *result = grad_reverse_init(GRAD_COS(grad->value));
-  result->operation = GRAD_OP_COS;
-  result->left = grad;
-  return result;
+grad_cache_t grad_cache_create(size_t n, size_t capacity, grad_cache_fn_t fn,
+                               void *user) {
+  assert(capacity > 0);
+  grad_cache_t cache = {0};
+  cache.fn = fn;
+  cache.user = user;
+  cache.n = n;
+  cache.capacity = capacity;
+  cache.buckets = 1;
+  while (cache.buckets < capacity) {
+    cache.buckets *= 2;
+  }
+  cache.x = malloc(sizeof(grad_real_t) * (capacity * n + 1));
+  cache.gradient = malloc(sizeof(grad_real_t) * (capacity * n + 1));
+  cache.value = malloc(sizeof(grad_real_t) * capacity);
+  cache.hash = malloc(sizeof(unsigned long long) * capacity);
+  cache.bucket = malloc(sizeof(size_t) * cache.buckets);
+  cache.chain = malloc(sizeof(size_t) * capacity);
+  cache.newer = malloc(sizeof(size_t) * capacity);
+  cache.older = malloc(sizeof(size_t) * capacity);
+  assert(cache.x && cache.gradient && cache.value && cache.hash &&
+         cache.bucket && cache.chain && cache.newer && cache.older);
+  for (size_t b = 0; b < cache.buckets; ++b) {
+    cache.bucket[b] = GRAD_CACHE_NONE;
+  }
+  cache.newest = GRAD_CACHE_NONE;
+  cache.oldest = GRAD_CACHE_NONE;
+  return cache;
 }
 
-grad_reverse_t *grad_reverse_exp(grad_reverse_t *grad) {
-  grad_reverse_t *result = grad_reverse_init(GRAD_EXP(grad->value));
-  result->operation = GRAD_OP_EXP;
-  result->left = grad;
-  return result;
+static uint64_t grad__fnv1a(const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
 }
 
-grad_reverse_t *grad_reverse_log(grad_reverse_t *grad) {
-  grad_reverse_t *result = grad_reverse_init(GRAD_LOG(grad->value));
-  result->operation = GRAD_OP_LOG;
-  result->left = grad;
+static void grad__cache_unlink(grad_cache_t *cache, size_t e) {
+  if (cache->newer[e] != GRAD_CACHE_NONE) {
+    cache->older[cache->newer[e]] = cache->older[e];
+  } else {
+    cache->newest = cache->older[e];
+  }
+  if (cache->older[e] != GRAD_CACHE_NONE) {
+    cache->newer[cache->older[e]] = cache->newer[e];
+  } else {
+    cache->oldest = cache->newer[e];
+  }
+}
+
+static void grad__cache_push(grad_cache_t *cache, size_t e) {
+  cache->newer[e] = GRAD_CACHE_NONE;
+  cache->older[e] = cache->newest;
+  if (cache->newest != GRAD_CACHE_NONE) {
+    cache->newer[cache->newest] = e;
+  } else {
+    cache->oldest = e;
+  }
+  cache->newest = e;
+}
+
+grad_real_t grad_cache_eval(grad_cache_t *cache, const grad_real_t *x,
+                            grad_real_t *gradient) {
+  size_t bytes = sizeof(grad_real_t) * cache->n;
+  uint64_t hash = grad__fnv1a(x, bytes);
+  size_t *head = &cache->bucket[hash & (cache->buckets - 1)];
+
+  for (size_t e = *head; e != GRAD_CACHE_NONE; e = cache->chain[e]) {
+    if (cache->hash[e] == hash &&
+        memcmp(&cache->x[e * cache->n], x, bytes) == 0) {
+      cache->hits += 1;
+      grad__cache_unlink(cache, e);
+      grad__cache_push(cache, e);
+      if (gradient) {
+        memcpy(gradient, &cache->gradient[e * cache->n], bytes);
+      }
+      return cache->value[e];
+    }
+  }
+
+  cache->misses += 1;
+  size_t e = cache->count;
+  if (cache->count < cache->capacity) {
+    cache->count += 1;
+  } else {
+    e = cache->oldest;
+    grad__cache_unlink(cache, e);
+    size_t *link = &cache->bucket[cache->hash[e] & (cache->buckets - 1)];
+    while (*link != e) {
+      link = &cache->chain[*link];
+    }
+    *link = cache->chain[e];
+  }
+  memcpy(&cache->x[e * cache->n], x, bytes);
+  cache->value[e] = cache->fn(x, &cache->gradient[e * cache->n], cache->user);
+  cache->hash[e] = hash;
+  cache->chain[e] = *head;
+  *head = e;
+  grad__cache_push(cache, e);
+  if (gradient) {
+    memcpy(gradient, &cache->gradient[e * cache->n], bytes);
+  }
+  return cache->value[e];
+}
+
+double grad_cache_hit_rate(const grad_cache_t *cache) {
+  size_t total = cache->hits + cache->misses;
+  return total ? (double)cache->hits / (double)total : 0;
+}
+
+void grad_cache_free(grad_cache_t *cache) {
+  free(cache->x);
+  free(cache->gradient);
+  free(cache->value);
+  free(cache->hash);
+  free(cache->bucket);
+  free(cache->chain);
+  free(cache->newer);
+  free(cache->older);
+  *cache = (grad_cache_t){0};
+}
+
+typedef struct grad__monte_carlo_task_t {
+  size_t nodes;
+  size_t payoff;
+  const size_t *normals;
+  size_t n_normals;
+  const size_t *params;
+  size_t n_params;
+  size_t paths;
+  uint64_t seed;
+  // Per block: path count, then mean and M2 of the payoff and each gradient.
+  double *blocks;
+} grad__monte_carlo_task_t;
+
+// Welford update of (mean, m2) with the k-th sample x.
+static void grad__welford(double *mean, double *m2, double k, double x) {
+  double delta = x - *mean;
+  *mean += delta / k;
+  *m2 += delta * (x - *mean);
+}
+
+static void grad__monte_carlo_blocks(size_t begin, size_t end, void *user) {
+  const grad__monte_carlo_task_t *task = user;
+  size_t n = task->nodes;
+  size_t width = 1 + 2 * (1 + task->n_params);
+
+  // Private tape with operand pointers rebased into it.
+  grad_reverse_t *tape = malloc(sizeof(grad_reverse_t) * n);
+  assert(tape);
+  memcpy(tape, grad_reverse_tape, sizeof(grad_reverse_t) * n);
+  for (size_t i = 0; i < n; ++i) {
+    size_t arity = grad__reverse_arity(tape[i].operation);
+    if (arity > 0) {
+      tape[i].left = tape + (tape[i].left - grad_reverse_tape);
+    }
+    if (arity > 1) {
+      tape[i].right = tape + (tape[i].right - grad_reverse_tape);
+    }
+  }
+
+  for (size_t b = begin; b < end; ++b) {
+    double *stats = &task->blocks[b * width];
+    size_t first = b * GRAD_MONTE_CARLO_BLOCK;
+    size_t last = first + GRAD_MONTE_CARLO_BLOCK < task->paths
+                      ? first + GRAD_MONTE_CARLO_BLOCK
+                      : task->paths;
+    for (size_t p = first; p < last; ++p) {
+      uint64_t stream = task->seed + p * 0xd1342543de82ef95ull;
+      uint64_t state = grad__random_next(&stream);
+      for (size_t k = 0; k < task->n_normals; k += 2) {
+        // Box-Muller, with u in (0, 1] so the log stays finite.
+        double u = (double)((grad__random_next(&state) >> 11) + 1) * 0x1p-53;
+        double v = (double)(grad__random_next(&state) >> 11) * 0x1p-53;
+        double r = sqrt(-2 * log(u));
+        double angle = 6.283185307179586 * v;
+        tape[task->normals[k]].value = (grad_real_t)(r * cos(angle));
+        if (k + 1 < task->n_normals) {
+          tape[task->normals[k + 1]].value = (grad_real_t)(r * sin(angle));
+        }
+      }
+      for (size_t i = 0; i <= task->payoff; ++i) {
+        grad_reverse_t *grad = &tape[i];
+        grad->derivative = (grad_real_t)0.0;
+        if (grad->operation != GRAD_OP_NONE) {
+          grad_real_t right = grad__reverse_arity(grad->operation) > 1
+                                  ? grad->right->value
+                                  : (grad_real_t)0.0;
+          grad->value =
+              grad__reverse_apply(grad->operation, grad->left->value, right);
+        }
+      }
+      tape[task->payoff].derivative = (grad_real_t)1.0;
+      for (size_t i = task->payoff + 1; i-- > 0;) {
+        grad_reverse_t *grad = &tape[i];
+        grad_real_t d = grad->derivative;
+        if (grad->operation == GRAD_OP_NONE || d == 0) {
+          continue;
+        }
+        if (grad->operation == GRAD_OP_ADD) {
+          grad->left->derivative += d;
+          grad->right->derivative += d;
+        } else if (grad->operation == GRAD_OP_MUL) {
+          grad->left->derivative += grad->right->value * d;
+          grad->right->derivative += grad->left->value * d;
+        } else {
+          grad_real_t d1, d2;
+          grad__reverse_unary_partials(grad, &d1, &d2);
+          grad->left->derivative += d1 * d;
+        }
+      }
+
+      double k = (double)(p - first + 1);
+      stats[0] = k;
+      grad__welford(&stats[1], &stats[2], k, tape[task->payoff].value);
+      for (size_t j = 0; j < task->n_params; ++j) {
+        grad__welford(&stats[3 + 2 * j], &stats[4 + 2 * j], k,
+                      tape[task->params[j]].derivative);
+      }
+    }
+  }
+  free(tape);
+}
+
+grad_monte_carlo_t grad_monte_carlo(grad_reverse_t *payoff,
+                                    grad_reverse_t *const *normals,
+                                    size_t n_normals,
+                                    grad_reverse_t *const *params,
+                                    size_t n_params, size_t paths,
+                                    uint64_t seed, grad_real_t *gradient,
+                                    grad_real_t *gradient_error) {
+  GRAD__TRACE(grad_trace_begin("monte_carlo"));
+  grad__monte_carlo_task_t task = {0};
+  task.nodes = grad_reverse_current_id;
+  task.payoff = (size_t)(payoff - grad_reverse_tape);
+  task.n_normals = n_normals;
+  task.n_params = n_params;
+  task.paths = paths;
+  task.seed = seed;
+  for (size_t i = 0; i <= task.payoff; ++i) {
+    assert(grad_reverse_tape[i].operation != GRAD_OP_BLACKBOX);
+  }
+
+  size_t width = 1 + 2 * (1 + n_params);
+  size_t blocks = (paths + GRAD_MONTE_CARLO_BLOCK - 1) / GRAD_MONTE_CARLO_BLOCK;
+  size_t *index = malloc(sizeof(size_t) * (n_normals + n_params + 1));
+  task.blocks = calloc(blocks * width + 1, sizeof(double));
+  assert(index && task.blocks);
+  for (size_t k = 0; k < n_normals; ++k) {
+    index[k] = (size_t)(normals[k] - grad_reverse_tape);
+  }
+  for (size_t j = 0; j < n_params; ++j) {
+    index[n_normals + j] = (size_t)(params[j] - grad_reverse_tape);
+  }
+  task.normals = index;
+  task.params = index + n_normals;
+  grad_parallel_for(blocks, 1, grad__monte_carlo_blocks, &task);
+
+  // Chan et al. pairwise merge of the block statistics, in block order.
+  double *total = calloc(width, sizeof(double));
+  assert(total);
+  for (size_t b = 0; b < blocks; ++b) {
+    const double *stats = &task.blocks[b * width];
+    double count = total[0] + stats[0];
+    for (size_t s = 1; s < width; s += 2) {
+      double delta = stats[s] - total[s];
+      total[s + 1] +=
+          stats[s + 1] + delta * delta * total[0] * stats[0] / count;
+      total[s] += delta * stats[0] / count;
+    }
+    total[0] = count;
+  }
+
+  grad_monte_carlo_t result = {paths, 0, 0};
+  double scale = paths > 1 ? 1.0 / ((double)paths * (double)(paths - 1)) : 0;
+  result.mean = (grad_real_t)total[1];
+  result.error = (grad_real_t)sqrt(total[2] * scale);
+  for (size_t j = 0; j < n_params; ++j) {
+    gradient[j] = (grad_real_t)total[3 + 2 * j];
+    if (gradient_error != NULL) {
+      gradient_error[j] = (grad_real_t)sqrt(total[4 + 2 * j] * scale);
+    }
+  }
+
+  free(total);
+  free(index);
+  free(task.blocks);
+  GRAD__TRACE(grad_trace_end("monte_carlo"));
   return result;
 }
 
-void grad_reverse_backward(grad_reverse_t *output) {
-  for (size_t i = 0; i < grad_reverse_current_id; ++i) {
-    grad_reverse_tape[i].derivative = (grad_real_t)0.0;
+#ifdef GRAD_DATASET
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef MADV_SEQUENTIAL
+#error "grad.h: GRAD_DATASET needs _DEFAULT_SOURCE before any #include"
+#endif
+
+int grad_dataset_open(grad_dataset_t *dataset, const char *path,
+                      size_t sample_bytes) {
+  assert(sample_bytes > 0);
+  *dataset = (grad_dataset_t){0};
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
   }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    close(fd);
+    return -1;
+  }
+  void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+  dataset->data = data;
+  dataset->bytes = (size_t)info.st_size;
+  dataset->sample_bytes = sample_bytes;
+  dataset->samples = dataset->bytes / sample_bytes;
+  return 0;
+}
 
-  output->derivative = 1.0;
+void grad_dataset_close(grad_dataset_t *dataset) {
+  if (dataset->data != NULL) {
+    munmap((void *)dataset->data, dataset->bytes);
+  }
+  *dataset = (grad_dataset_t){0};
+}
 
-  for (ssize_t i = (ssize_t)grad_reverse_current_id - 1; i >= 0; --i) {
-    grad_reverse_t *grad = &grad_reverse_tape[i];
+// Applies advice to the whole pages covering samples [begin, end).
+static void grad__dataset_advise(const grad_dataset_t *dataset, size_t begin,
+                                 size_t end, int advice) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t first = begin * dataset->sample_bytes / page * page;
+  size_t last = end * dataset->sample_bytes;
+  if (advice == MADV_DONTNEED) {
+    // Only release pages wholly before the next sample.
+    last = last / page * page;
+  }
+  if (last > first) {
+    madvise((void *)(dataset->data + first), last - first, advice);
+  }
+}
 
-    switch (grad->operation) {
-    case GRAD_OP_ADD: {
-      grad->left->derivative += grad->derivative;
-      grad->right->derivative += grad->derivative;
-      break;
+grad_real_t grad_dataset_accumulate(const grad_dataset_t *dataset,
+                                    size_t begin, size_t end, size_t chunk,
+                                    grad_dataset_loss_fn_t loss, void *user,
+                                    const grad_real_t *params,
+                                    size_t n_params, grad_real_t *gradient) {
+  GRAD__TRACE(grad_trace_begin("dataset"));
+  assert(begin <= end && end <= dataset->samples && chunk > 0);
+  grad_reverse_t **leaves = malloc(sizeof(grad_reverse_t *) * (n_params + 1));
+  grad_real_t *chunk_gradient = malloc(sizeof(grad_real_t) * (n_params + 1));
+  double *sum = calloc(n_params + 1, sizeof(double));
+  assert(leaves && chunk_gradient && sum);
+  double total = 0;
+
+  size_t window = (GRAD_DATASET_PREFETCH + 1) * chunk;
+  grad__dataset_advise(dataset, begin,
+                       end - begin < window ? end : begin + window,
+                       MADV_WILLNEED);
+  for (size_t first = begin; first < end; first += chunk) {
+    size_t count = end - first < chunk ? end - first : chunk;
+    size_t ahead = first + window;
+    if (ahead < end) {
+      grad__dataset_advise(dataset, ahead,
+                           end - ahead < chunk ? end : ahead + chunk,
+                           MADV_WILLNEED);
     }
-    case GRAD_OP_MUL: {
-      grad->left->derivative += grad->right->value * grad->derivative;
-      grad->right->derivative += grad->left->value * grad->derivative;
-      break;
+
+    grad_reverse_start_scope();
+    grad_reverse_t *block = grad_reverse_bind(params, chunk_gradient, n_params);
+    for (size_t j = 0; j < n_params; ++j) {
+      leaves[j] = &block[j];
     }
-    case GRAD_OP_NEG: {
-      grad->left->derivative += -1.0 * grad->derivative;
-      break;
+    grad_reverse_t *value =
+        loss(leaves, dataset->data + first * dataset->sample_bytes, count,
+             user);
+    grad_reverse_backward(value);
+    total += value->value;
+    for (size_t j = 0; j < n_params; ++j) {
+      sum[j] += chunk_gradient[j];
     }
-    case GRAD_OP_INV: {
-      grad->left->derivative +=
-          -grad->derivative / (grad->left->value * grad->left->value);
-      break;
+
+    grad__dataset_advise(dataset, first, first + count, MADV_DONTNEED);
+  }
+
+  for (size_t j = 0; j < n_params; ++j) {
+    gradient[j] += (grad_real_t)sum[j];
+  }
+  free(leaves);
+  free(chunk_gradient);
+  free(sum);
+  GRAD__TRACE(grad_trace_end("dataset"));
+  return (grad_real_t)total;
+}
+#endif // GRAD_DATASET
+
+// Dormand-Prince 5(4) over a plain state vector, shared by the ODE drivers.
+// Work arrays are sized for the largest augmented system any driver builds.
+#define GRAD__ODE_WORK (GRAD_ODE_MAX_STATE * (GRAD_ODE_MAX_PARAMS + 2))
+
+typedef void (*grad__ode_field_t)(grad_real_t t, const grad_real_t *z,
+                                  grad_real_t *dz, void *ctx);
+
+static size_t grad__ode_dopri5(grad__ode_field_t field, void *ctx, size_t dim,
+                               grad_real_t t0, grad_real_t t1, grad_real_t *z,
+                               grad_real_t rtol, grad_real_t atol,
+                               grad_real_t *step, size_t max_steps) {
+  static const grad_real_t c[7] = {0,       1.0 / 5, 3.0 / 10, 4.0 / 5,
+                                   8.0 / 9, 1,       1};
+  static const grad_real_t a[7][6] = {
+      {0},
+      {1.0 / 5},
+      {3.0 / 40, 9.0 / 40},
+      {44.0 / 45, -56.0 / 15, 32.0 / 9},
+      {19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729},
+      {9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176,
+       -5103.0 / 18656},
+      {35.0 / 384, 0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84},
+  };
+  static const grad_real_t e[7] = {71.0 / 57600,  0,           -71.0 / 16695,
+                                   71.0 / 1920,   -17253.0 / 339200,
+                                   22.0 / 525,    -1.0 / 40};
+
+  assert(dim <= GRAD__ODE_WORK);
+  grad_real_t k[7][GRAD__ODE_WORK];
+  grad_real_t stage[GRAD__ODE_WORK];
+
+  grad_real_t span = t1 - t0;
+  if (span == 0) {
+    return 0;
+  }
+  grad_real_t direction = span > 0 ? (grad_real_t)1.0 : (grad_real_t)-1.0;
+  grad_real_t h = *step != 0 ? fabs(*step) : fabs(span) / 100;
+
+  grad_real_t t = t0;
+  size_t steps = 0;
+  field(t, z, k[0], ctx);
+
+  while ((t1 - t) * direction > 0) {
+    assert(steps < max_steps);
+    if (h > fabs(t1 - t)) {
+      h = fabs(t1 - t);
     }
-    case GRAD_OP_SIN: {
-      grad->left->derivative += GRAD_COS(grad->left->value) * grad->derivative;
-      break;
+    grad_real_t dt = h * direction;
+
+    for (size_t s = 1; s < 7; ++s) {
+      for (size_t i = 0; i < dim; ++i) {
+        grad_real_t acc = 0;
+        for (size_t j = 0; j < s; ++j) {
+          acc += a[s][j] * k[j][i];
+        }
+        stage[i] = z[i] + dt * acc;
+      }
+      field(t + c[s] * dt, stage, k[s], ctx);
     }
-    case GRAD_OP_COS: {
-      grad->left->derivative += -GRAD_SIN(grad->left->value) * grad->derivative;
-      break;
+
+    // stage now holds the 5th order solution (FSAL: k[6] = f(t + dt, stage)).
+    grad_real_t err = 0;
+    for (size_t i = 0; i < dim; ++i) {
+      grad_real_t delta = 0;
+      for (size_t s = 0; s < 7; ++s) {
+        delta += e[s] * k[s][i];
+      }
+      grad_real_t scale =
+          atol + rtol * (fabs(z[i]) > fabs(stage[i]) ? fabs(z[i])
+                                                     : fabs(stage[i]));
+      grad_real_t ratio = dt * delta / scale;
+      err += ratio * ratio;
     }
-    case GRAD_OP_EXP: {
-      grad->left->derivative += GRAD_EXP(grad->left->value) * grad->derivative;
-      break;
+    err = GRAD_SQRT(err / (grad_real_t)dim);
+
+    grad_real_t factor =
+        err == 0 ? (grad_real_t)5.0
+                 : (grad_real_t)0.9 * GRAD_POW(err, (grad_real_t)-0.2);
+    factor = factor < 0.2 ? (grad_real_t)0.2 : factor > 5 ? (grad_real_t)5.0
+                                                          : factor;
+
+    if (err <= 1) {
+      t += dt;
+      memcpy(z, stage, sizeof(grad_real_t) * dim);
+      memcpy(k[0], k[6], sizeof(grad_real_t) * dim);
+      steps += 1;
     }
-    case GRAD_OP_LOG: {
-      grad->left->derivative += grad->derivative / grad->left->value;
-      break;
+    h *= factor;
+    assert(h > fabs(t) * 1e-12);
+  }
+
+  *step = h;
+  return steps;
+}
+
+typedef struct grad__ode_ctx_t {
+  const grad_ode_t *ode;
+  const grad_real_t *p;
+} grad__ode_ctx_t;
+
+// Records f(t, y, p) on top of the current tape. Leaves the nodes in place so
+// the caller can sweep them; the caller rewinds grad_reverse_current_id.
+static void grad__ode_record(const grad_ode_t *ode, grad_real_t t,
+                             const grad_real_t *y, const grad_real_t *p,
+                             grad_reverse_t **y_leaf, grad_reverse_t **p_leaf,
+                             grad_reverse_t **dydt) {
+  for (size_t i = 0; i < ode->state_size; ++i) {
+    y_leaf[i] = grad_reverse_init(y[i]);
+  }
+  for (size_t i = 0; i < ode->param_size; ++i) {
+    p_leaf[i] = grad_reverse_init(p[i]);
+  }
+  ode->rhs(t, y_leaf, p_leaf, dydt, ode->user);
+}
+
+static void grad__ode_forward_field(grad_real_t t, const grad_real_t *y,
+                                    grad_real_t *dy, void *ctx) {
+  const grad__ode_ctx_t *c = ctx;
+  grad_reverse_t *y_leaf[GRAD_ODE_MAX_STATE];
+  grad_reverse_t *p_leaf[GRAD_ODE_MAX_PARAMS];
+  grad_reverse_t *dydt[GRAD_ODE_MAX_STATE];
+
+  size_t mark = grad_reverse_current_id;
+  grad__ode_record(c->ode, t, y, c->p, y_leaf, p_leaf, dydt);
+  for (size_t i = 0; i < c->ode->state_size; ++i) {
+    dy[i] = dydt[i]->value;
+  }
+  grad_reverse_current_id = mark;
+}
+
+// Augmented state [y, a, g] with a' = -a^T df/dy and g' = -a^T df/dp. The
+// vector-Jacobian products come from one reverse sweep over a single
+// right-hand side evaluation.
+static void grad__ode_adjoint_field(grad_real_t t, const grad_real_t *z,
+                                    grad_real_t *dz, void *ctx) {
+  const grad__ode_ctx_t *c = ctx;
+  size_t n = c->ode->state_size;
+  size_t np = c->ode->param_size;
+  grad_reverse_t *y_leaf[GRAD_ODE_MAX_STATE];
+  grad_reverse_t *p_leaf[GRAD_ODE_MAX_PARAMS];
+  grad_reverse_t *dydt[GRAD_ODE_MAX_STATE];
+
+  size_t mark = grad_reverse_current_id;
+  grad__ode_record(c->ode, t, z, c->p, y_leaf, p_leaf, dydt);
+  for (size_t i = 0; i < n; ++i) {
+    dz[i] = dydt[i]->value;
+  }
+  grad__reverse_vjp(mark, dydt, z + n, n);
+  for (size_t i = 0; i < n; ++i) {
+    dz[n + i] = -y_leaf[i]->derivative;
+  }
+  for (size_t i = 0; i < np; ++i) {
+    dz[2 * n + i] = -p_leaf[i]->derivative;
+  }
+  grad_reverse_current_id = mark;
+}
+
+void grad_ode_solve(grad_ode_t *ode, grad_real_t t0, grad_real_t t1,
+                    grad_real_t *y, const grad_real_t *p) {
+  assert(ode->state_size <= GRAD_ODE_MAX_STATE);
+  assert(ode->param_size <= GRAD_ODE_MAX_PARAMS);
+
+  grad__ode_ctx_t ctx = {ode, p};
+  grad_real_t step = 0;
+  grad_real_t segment = (t1 - t0) / GRAD_ODE_CHECKPOINTS;
+
+  ode->t0 = t0;
+  ode->t1 = t1;
+  ode->steps = 0;
+  for (size_t k = 0; k < GRAD_ODE_CHECKPOINTS; ++k) {
+    memcpy(ode->checkpoint[k], y, sizeof(grad_real_t) * ode->state_size);
+    grad_real_t end =
+        k + 1 == GRAD_ODE_CHECKPOINTS ? t1 : t0 + (k + 1) * segment;
+    ode->steps += grad__ode_dopri5(grad__ode_forward_field, &ctx,
+                                   ode->state_size, t0 + k * segment, end, y,
+                                   ode->rtol, ode->atol, &step, ode->max_steps);
+  }
+  memcpy(ode->checkpoint[GRAD_ODE_CHECKPOINTS], y,
+         sizeof(grad_real_t) * ode->state_size);
+}
+
+void grad_ode_adjoint(grad_ode_t *ode, const grad_real_t *p,
+                      const grad_real_t *y1_bar, grad_real_t *y0_bar,
+                      grad_real_t *p_bar) {
+  size_t n = ode->state_size;
+  size_t np = ode->param_size;
+  grad__ode_ctx_t ctx = {ode, p};
+  grad_real_t z[GRAD__ODE_WORK] = {0};
+  grad_real_t step = 0;
+  grad_real_t segment = (ode->t1 - ode->t0) / GRAD_ODE_CHECKPOINTS;
+
+  memcpy(z + n, y1_bar, sizeof(grad_real_t) * n);
+
+  // The state is integrated backwards alongside the adjoint and reset from
+  // the stored checkpoint at each segment, so drift stays bounded while
+  // memory stays independent of the number of steps.
+  for (size_t k = GRAD_ODE_CHECKPOINTS; k > 0; --k) {
+    memcpy(z, ode->checkpoint[k], sizeof(grad_real_t) * n);
+    grad_real_t start =
+        k == GRAD_ODE_CHECKPOINTS ? ode->t1 : ode->t0 + k * segment;
+    grad__ode_dopri5(grad__ode_adjoint_field, &ctx, 2 * n + np, start,
+                     ode->t0 + (k - 1) * segment, z, ode->rtol, ode->atol,
+                     &step, ode->max_steps);
+  }
+
+  memcpy(y0_bar, z + n, sizeof(grad_real_t) * n);
+  memcpy(p_bar, z + 2 * n, sizeof(grad_real_t) * np);
+}
+
+// Augmented state [y, S] with S' = df/dy S + df/dp. Seeding y with the rows
+// of S and p with unit tangents makes one forward-mode evaluation produce the
+// whole sensitivity right-hand side, one tangent lane per parameter.
+static void grad__ode_sensitivity_field(grad_real_t t, const grad_real_t *z,
+                                        grad_real_t *dz, void *ctx) {
+  const grad__ode_ctx_t *c = ctx;
+  size_t n = c->ode->state_size;
+  size_t np = c->ode->param_size;
+  grad_forward_t y[GRAD_ODE_MAX_STATE];
+  grad_forward_t p[GRAD_ODE_MAX_PARAMS];
+  grad_forward_t dydt[GRAD_ODE_MAX_STATE];
+
+  size_t saved_id = grad_forward_current_id;
+  grad_forward_start_scope();
+  for (size_t j = 0; j < np; ++j) {
+    p[j] = grad_forward_init(c->p[j]);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    memset(&y[i], 0, sizeof(grad_forward_t));
+    y[i].value = z[i];
+    memcpy(y[i].derivative, z + n + i * np, sizeof(grad_real_t) * np);
+  }
+
+  c->ode->forward_rhs(t, y, p, dydt, c->ode->user);
+
+  for (size_t i = 0; i < n; ++i) {
+    dz[i] = dydt[i].value;
+    memcpy(dz + n + i * np, dydt[i].derivative, sizeof(grad_real_t) * np);
+  }
+  grad_forward_current_id = saved_id;
+}
+
+void grad_ode_sensitivity(grad_ode_t *ode, grad_real_t t0, grad_real_t t1,
+                          grad_real_t *y, const grad_real_t *p,
+                          grad_real_t *sensitivity) {
+  size_t n = ode->state_size;
+  size_t np = ode->param_size;
+  assert(n <= GRAD_ODE_MAX_STATE);
+  assert(np <= GRAD_ODE_MAX_PARAMS);
+  assert(np <= GRAD_FORWARD_TAPE_SIZE);
+
+  grad__ode_ctx_t ctx = {ode, p};
+  grad_real_t z[GRAD__ODE_WORK];
+  grad_real_t step = 0;
+
+  memcpy(z, y, sizeof(grad_real_t) * n);
+  memcpy(z + n, sensitivity, sizeof(grad_real_t) * n * np);
+
+  // Error control runs over the sensitivities as well as the state.
+  ode->t0 = t0;
+  ode->t1 = t1;
+  ode->steps =
+      grad__ode_dopri5(grad__ode_sensitivity_field, &ctx, n * (1 + np), t0, t1,
+                       z, ode->rtol, ode->atol, &step, ode->max_steps);
+
+  memcpy(y, z, sizeof(grad_real_t) * n);
+  memcpy(sensitivity, z + n, sizeof(grad_real_t) * n * np);
+}
+
+// Records fn(x, p) on top of the current tape; the caller rewinds.
+static void grad__implicit_record(const grad_implicit_t *imp,
+                                  const grad_real_t *x, const grad_real_t *p,
+                                  grad_reverse_t **x_leaf,
+                                  grad_reverse_t **p_leaf,
+                                  grad_reverse_t **out) {
+  for (size_t i = 0; i < imp->state_size; ++i) {
+    x_leaf[i] = grad_reverse_init(x[i]);
+  }
+  for (size_t i = 0; i < imp->param_size; ++i) {
+    p_leaf[i] = grad_reverse_init(p[i]);
+  }
+  imp->fn(x_leaf, p_leaf, out, imp->user);
+}
+
+// Jacobian d out / d x of the recording since begin, one sweep per row.
+static void grad__implicit_jacobian(const grad_implicit_t *imp, size_t begin,
+                                    grad_reverse_t *const *x_leaf,
+                                    grad_reverse_t *const *out,
+                                    grad_real_t *jacobian) {
+  size_t n = imp->state_size;
+  grad_real_t seed[GRAD_IMPLICIT_MAX_STATE] = {0};
+  for (size_t i = 0; i < n; ++i) {
+    seed[i] = 1;
+    grad__reverse_vjp(begin, out, seed, n);
+    seed[i] = 0;
+    for (size_t j = 0; j < n; ++j) {
+      jacobian[i * n + j] = x_leaf[j]->derivative;
     }
-    default:
+  }
+}
+
+// Solves A x = b in place (b becomes x) by Gaussian elimination with partial
+// pivoting. A is n x n, row-major, and is destroyed.
+static void grad__solve_dense(size_t n, grad_real_t *a, grad_real_t *b) {
+  for (size_t k = 0; k < n; ++k) {
+    size_t pivot = k;
+    for (size_t i = k + 1; i < n; ++i) {
+      if (fabs(a[i * n + k]) > fabs(a[pivot * n + k])) {
+        pivot = i;
+      }
+    }
+    assert(a[pivot * n + k] != 0);
+    if (pivot != k) {
+      for (size_t j = 0; j < n; ++j) {
+        grad_real_t tmp = a[k * n + j];
+        a[k * n + j] = a[pivot * n + j];
+        a[pivot * n + j] = tmp;
+      }
+      grad_real_t tmp = b[k];
+      b[k] = b[pivot];
+      b[pivot] = tmp;
+    }
+    for (size_t i = k + 1; i < n; ++i) {
+      grad_real_t factor = a[i * n + k] / a[k * n + k];
+      for (size_t j = k; j < n; ++j) {
+        a[i * n + j] -= factor * a[k * n + j];
+      }
+      b[i] -= factor * b[k];
+    }
+  }
+  for (size_t k = n; k-- > 0;) {
+    for (size_t j = k + 1; j < n; ++j) {
+      b[k] -= a[k * n + j] * b[j];
+    }
+    b[k] /= a[k * n + k];
+  }
+}
+
+// Runs the solver without keeping any iteration on the tape: each iteration
+// records one evaluation and rewinds it before the next.
+void grad_implicit_solve(grad_implicit_t *imp, grad_real_t *x,
+                         const grad_real_t *p) {
+  size_t n = imp->state_size;
+  assert(n <= GRAD_IMPLICIT_MAX_STATE);
+  assert(imp->param_size <= GRAD_IMPLICIT_MAX_PARAMS);
+
+  grad_reverse_t *x_leaf[GRAD_IMPLICIT_MAX_STATE];
+  grad_reverse_t *p_leaf[GRAD_IMPLICIT_MAX_PARAMS];
+  grad_reverse_t *out[GRAD_IMPLICIT_MAX_STATE];
+  grad_real_t jacobian[GRAD_IMPLICIT_MAX_STATE * GRAD_IMPLICIT_MAX_STATE];
+  grad_real_t step[GRAD_IMPLICIT_MAX_STATE];
+
+  size_t mark = grad_reverse_current_id;
+  for (imp->iterations = 0; imp->iterations < imp->max_iter;
+       ++imp->iterations) {
+    grad__implicit_record(imp, x, p, x_leaf, p_leaf, out);
+
+    if (imp->kind == GRAD_IMPLICIT_ROOT) {
+      for (size_t i = 0; i < n; ++i) {
+        step[i] = -out[i]->value;
+      }
+      grad__implicit_jacobian(imp, mark, x_leaf, out, jacobian);
+      grad__solve_dense(n, jacobian, step);
+    } else {
+      for (size_t i = 0; i < n; ++i) {
+        step[i] = out[i]->value - x[i];
+      }
+    }
+    grad_reverse_current_id = mark;
+
+    grad_real_t change = 0;
+    for (size_t i = 0; i < n; ++i) {
+      x[i] += step[i];
+      change = fabs(step[i]) > change ? fabs(step[i]) : change;
+    }
+    if (change < imp->tol) {
       break;
     }
   }
 }
 
+// Implicit function theorem at the solution x. For a root F(x, p) = 0 the
+// adjoint system F_x^T l = x_bar is solved densely from n vector-Jacobian
+// products; for a fixed point x = G(x, p), l = x_bar + G_x^T l is iterated
+// with one product per step. Either way p_bar comes from a single recording,
+// so cost and memory do not depend on how the forward solve converged.
+void grad_implicit_vjp(grad_implicit_t *imp, const grad_real_t *x,
+                       const grad_real_t *p, const grad_real_t *x_bar,
+                       grad_real_t *p_bar) {
+  size_t n = imp->state_size;
+  size_t np = imp->param_size;
+  assert(n <= GRAD_IMPLICIT_MAX_STATE);
+  assert(np <= GRAD_IMPLICIT_MAX_PARAMS);
+
+  grad_reverse_t *x_leaf[GRAD_IMPLICIT_MAX_STATE];
+  grad_reverse_t *p_leaf[GRAD_IMPLICIT_MAX_PARAMS];
+  grad_reverse_t *out[GRAD_IMPLICIT_MAX_STATE];
+  grad_real_t lambda[GRAD_IMPLICIT_MAX_STATE];
+
+  size_t mark = grad_reverse_current_id;
+  grad__implicit_record(imp, x, p, x_leaf, p_leaf, out);
+  memcpy(lambda, x_bar, sizeof(grad_real_t) * n);
+
+  if (imp->kind == GRAD_IMPLICIT_ROOT) {
+    grad_real_t jacobian[GRAD_IMPLICIT_MAX_STATE * GRAD_IMPLICIT_MAX_STATE];
+    grad_real_t transposed[GRAD_IMPLICIT_MAX_STATE * GRAD_IMPLICIT_MAX_STATE];
+    grad__implicit_jacobian(imp, mark, x_leaf, out, jacobian);
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t j = 0; j < n; ++j) {
+        transposed[j * n + i] = jacobian[i * n + j];
+      }
+    }
+    grad__solve_dense(n, transposed, lambda);
+    for (size_t i = 0; i < n; ++i) {
+      lambda[i] = -lambda[i];
+    }
+    imp->iterations = n;
+  } else {
+    for (imp->iterations = 0; imp->iterations < imp->max_iter;
+         ++imp->iterations) {
+      grad__reverse_vjp(mark, out, lambda, n);
+      grad_real_t change = 0;
+      for (size_t i = 0; i < n; ++i) {
+        grad_real_t next = x_bar[i] + x_leaf[i]->derivative;
+        change = fabs(next - lambda[i]) > change ? fabs(next - lambda[i])
+                                                 : change;
+        lambda[i] = next;
+      }
+      if (change < imp->tol) {
+        break;
+      }
+    }
+  }
+
+  grad__reverse_vjp(mark, out, lambda, n);
+  for (size_t i = 0; i < np; ++i) {
+    p_bar[i] = p_leaf[i]->derivative;
+  }
+  grad_reverse_current_id = mark;
+}
+
 #endif // GRAD_IMPLEMENTATION
 
+// Defined after the implementation so the library's own definitions and
+// internal calls are left alone; nodes those calls record inherit the
+// location of the user call that triggered them.
+#ifdef GRAD_SOURCE_PROFILE
+#define GRAD__SOURCE_CALL(call) (grad_source_mark(__FILE__, __LINE__), call)
+#define grad_reverse_init(value) GRAD__SOURCE_CALL(grad_reverse_init(value))
+#define grad_reverse_add(left, right)                                          \
+  GRAD__SOURCE_CALL(grad_reverse_add(left, right))
+#define grad_reverse_sub(left, right)                                          \
+  GRAD__SOURCE_CALL(grad_reverse_sub(left, right))
+#define grad_reverse_mul(left, right)                                          \
+  GRAD__SOURCE_CALL(grad_reverse_mul(left, right))
+#define grad_reverse_div(left, right)                                          \
+  GRAD__SOURCE_CALL(grad_reverse_div(left, right))
+#define grad_reverse_neg(grad) GRAD__SOURCE_CALL(grad_reverse_neg(grad))
+#define grad_reverse_inv(grad) GRAD__SOURCE_CALL(grad_reverse_inv(grad))
+#define grad_reverse_exp(grad) GRAD__SOURCE_CALL(grad_reverse_exp(grad))
+#define grad_reverse_log(grad) GRAD__SOURCE_CALL(grad_reverse_log(grad))
+#define grad_reverse_sin(grad) GRAD__SOURCE_CALL(grad_reverse_sin(grad))
+#define grad_reverse_cos(grad) GRAD__SOURCE_CALL(grad_reverse_cos(grad))
+#define grad_reverse_blackbox(box, inputs, outputs)                            \
+  GRAD__SOURCE_CALL(grad_reverse_blackbox(box, inputs, outputs))
+#endif // GRAD_SOURCE_PROFILE
+
 #endif // GRAD_H_
 
 /*
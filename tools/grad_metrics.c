@@ -0,0 +1,130 @@
+// Prints the metrics a process built with -DGRAD_METRICS_SHM publishes after
+// grad_metrics_open(name), without stopping it.
+//
+//   cc -O2 -o grad_metrics tools/grad_metrics.c
+//   ./grad_metrics [name] [interval_ms] [count]
+//
+// name defaults to /grad_metrics. Rates are taken over each interval; count 0
+// (the default) prints until interrupted.
+
+#define _DEFAULT_SOURCE
+#define GRAD_METRICS_SHM
+#include "../grad.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct metrics_sample_t {
+  uint64_t now_ns;
+  uint64_t tapes;
+  uint64_t backwards;
+  uint64_t backward_nodes;
+  uint64_t backward_ns;
+  uint64_t backward_latency[GRAD_METRICS_BUCKETS];
+  uint64_t peak_tape;
+  uint64_t pool_threads;
+  uint64_t pool_tasks;
+  uint64_t pool_busy_ns;
+} metrics_sample_t;
+
+static uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t metrics_load(_Atomic uint64_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static metrics_sample_t metrics_read(grad_metrics_t *metrics) {
+  metrics_sample_t sample;
+  sample.now_ns = metrics_now_ns();
+  sample.tapes = metrics_load(&metrics->tapes);
+  sample.backwards = metrics_load(&metrics->backwards);
+  sample.backward_nodes = metrics_load(&metrics->backward_nodes);
+  sample.backward_ns = metrics_load(&metrics->backward_ns);
+  for (int b = 0; b < GRAD_METRICS_BUCKETS; ++b) {
+    sample.backward_latency[b] = metrics_load(&metrics->backward_latency[b]);
+  }
+  sample.peak_tape = metrics_load(&metrics->peak_tape);
+  sample.pool_threads = metrics_load(&metrics->pool_threads);
+  sample.pool_tasks = metrics_load(&metrics->pool_tasks);
+  sample.pool_busy_ns = metrics_load(&metrics->pool_busy_ns);
+  return sample;
+}
+
+// Upper edge, in ns, of the bucket holding the given quantile of the backward
+// passes in the interval; 0 if there were none.
+static double metrics_percentile(const metrics_sample_t *before,
+                                 const metrics_sample_t *after,
+                                 double quantile) {
+  uint64_t total = after->backwards - before->backwards;
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t seen = 0;
+  for (int b = 0; b < GRAD_METRICS_BUCKETS; ++b) {
+    seen += after->backward_latency[b] - before->backward_latency[b];
+    if ((double)seen >= quantile * (double)total) {
+      return (double)((uint64_t)2 << b);
+    }
+  }
+  return (double)((uint64_t)2 << (GRAD_METRICS_BUCKETS - 1));
+}
+
+int main(int argc, char **argv) {
+  const char *name = argc > 1 ? argv[1] : "/grad_metrics";
+  double interval = argc > 2 ? atof(argv[2]) / 1000 : 1;
+  long count = argc > 3 ? atol(argv[3]) : 0;
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open shared memory %s\n", name);
+    return 1;
+  }
+  grad_metrics_t *metrics =
+      mmap(NULL, sizeof(grad_metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (metrics == MAP_FAILED || metrics->magic != GRAD_METRICS_MAGIC ||
+      metrics->size != sizeof(grad_metrics_t)) {
+    fprintf(stderr, "%s is not a grad.h metrics segment\n", name);
+    return 1;
+  }
+
+  printf("pid %lld\n", (long long)metrics->pid);
+  printf("%10s %10s %10s %10s %10s %10s %10s %8s\n", "tapes/s", "bwd/s",
+         "nodes/s", "p50_us", "p99_us", "mean_us", "peak_tape", "pool%");
+  metrics_sample_t before = metrics_read(metrics);
+  for (long i = 0; count == 0 || i < count; ++i) {
+    struct timespec pause = {(time_t)interval,
+                             (long)((interval - (double)(time_t)interval) *
+                                    1e9)};
+    nanosleep(&pause, NULL);
+    metrics_sample_t after = metrics_read(metrics);
+    double seconds = (double)(after.now_ns - before.now_ns) * 1e-9;
+    uint64_t backwards = after.backwards - before.backwards;
+    double mean = backwards ? (double)(after.backward_ns - before.backward_ns) /
+                                  (double)backwards
+                            : 0;
+    double pool =
+        after.pool_threads
+            ? (double)(after.pool_busy_ns - before.pool_busy_ns) * 1e-9 /
+                  (seconds * (double)after.pool_threads)
+            : 0;
+    printf("%10.1f %10.1f %10.3g %10.2f %10.2f %10.2f %10llu %7.1f%%\n",
+           (double)(after.tapes - before.tapes) / seconds,
+           (double)backwards / seconds,
+           (double)(after.backward_nodes - before.backward_nodes) / seconds,
+           metrics_percentile(&before, &after, 0.5) * 1e-3,
+           metrics_percentile(&before, &after, 0.99) * 1e-3, mean * 1e-3,
+           (unsigned long long)after.peak_tape, pool * 100);
+    fflush(stdout);
+    before = after;
+  }
+  munmap(metrics, sizeof(grad_metrics_t));
+  return 0;
+}